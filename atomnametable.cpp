@@ -0,0 +1,31 @@
+#include "atomnametable.h"
+
+AtomNameTable::AtomNameTable()
+    : d(new Data)
+{
+}
+
+AtomNameTable AtomNameTable::fromArena(const QByteArray &arena, const QVector<int> &offsets)
+{
+    AtomNameTable table;
+    table.d->arena = arena;
+    table.d->offsets = offsets;
+    return table;
+}
+
+const char *AtomNameTable::utf8(int index) const
+{
+    if (index < 0 || index >= d->offsets.size()) {
+        return nullptr;
+    }
+    return d->arena.constData() + d->offsets[index];
+}
+
+QString AtomNameTable::name(int index) const
+{
+    const char *name = utf8(index);
+    if (!name) {
+        return QString("Atom_%1").arg(index + 1);
+    }
+    return QString::fromUtf8(name);
+}
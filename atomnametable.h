@@ -0,0 +1,36 @@
+#ifndef ATOMNAMETABLE_H
+#define ATOMNAMETABLE_H
+
+#include <QByteArray>
+#include <QSharedData>
+#include <QSharedDataPointer>
+#include <QString>
+#include <QVector>
+
+// Interned atom names: one contiguous UTF-8 arena of NUL-terminated names
+// plus the offset of each name. The table is implicitly shared, so copying
+// it (e.g. as part of LSQParameters) does not copy the names.
+class AtomNameTable
+{
+public:
+    AtomNameTable();
+
+    // Adopt an arena filled by the Fortran bridge (offsets are 0-based)
+    static AtomNameTable fromArena(const QByteArray &arena, const QVector<int> &offsets);
+
+    // Pointer into the arena, or nullptr if index is out of range
+    const char *utf8(int index) const;
+
+    // Decoded name; falls back to "Atom_<index+1>" when index is out of range
+    QString name(int index) const;
+
+private:
+    struct Data : public QSharedData {
+        QByteArray arena;
+        QVector<int> offsets;
+    };
+
+    QSharedDataPointer<Data> d;
+};
+
+#endif // ATOMNAMETABLE_H
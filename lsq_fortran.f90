@@ -2,15 +2,100 @@ module lsq_module
     use iso_c_binding
     implicit none
     
+    ! Resolution shells and Fo bins reported by the statistics stage
+    integer, parameter :: num_stat_bins = 10
+    
+    ! Per-bin sums: 1=Nref, 2=Sum|Fo|, 3=Sum||Fo|-|Fc||,
+    !               4=Sum w*(Fo^2-Fc^2)^2, 5=Sum w*(Fo^2)^2, 6=Nref with w > 0
+    ! R1 (1-3) counts every reflection above the cutoff, whatever its weight
+    integer, parameter :: num_stat_sums = 6
+    
+    ! Reflections per block of refine_cycle: weights are computed for a whole
+    ! block in vectorizable loops before the block is scattered into the bins
+    integer, parameter :: weight_block = 256
+    
+    ! Weighting scheme used by the statistics (0-based combo index) and its
+    ! parameters P(1..10), the coefficients a(1..n) for scheme 16 (Chebyshev)
+    integer, parameter :: sigma_scheme = 4  ! #5, W=1/Sigma(Fo)^2
+    integer, parameter :: chebyshev_scheme = 15
+    integer, parameter :: max_weight_coeffs = 10
+    integer :: weight_scheme = 0
+    integer :: num_weight_coeffs = 0
+    real(c_double) :: weight_coeffs(max_weight_coeffs) = 0.0d0
+    
+    ! Chebyshev weight fit: Fo bins of its own (1=Nref, 2=Sum Fo, 3=Sum (Fo^2-Fc^2)^2),
+    ! at least min_bins_per_coeff bins per fitted coefficient so the fit smooths
+    ! the residuals instead of interpolating them
+    integer, parameter :: num_weight_fit_bins = 30
+    integer, parameter :: min_bins_per_coeff = 3
+    integer :: weight_fit_coeffs = 0
+    logical :: weights_refined = .false.
+    real(c_double) :: weight_fit_sums(3, num_weight_fit_bins) = 0.0d0
+    
+    ! Full-matrix mixed-precision solve: the normal matrix is accumulated and
+    ! factorized in single precision, shifts are refined in double precision.
+    ! Above this condition estimate the solve falls back to double precision.
+    real(c_double), parameter :: mixed_cond_limit = 1.0d5
+    integer, parameter :: max_refinement_steps = 10
+    
+    ! Cholesky factor of the last full-matrix cycle, kept for esds. Only the
+    ! factor of the precision actually used is allocated.
+    integer :: cov_np = 0
+    real(c_float), allocatable :: cov_factor_sp(:)
+    real(c_double), allocatable :: cov_factor_dp(:)
+    real(c_double), allocatable :: cov_scale(:)
+    real(c_double) :: cov_variance_scale = 1.0d0
+    real(c_double) :: cov_esd_error = 0.0d0  ! Bound on the esds' relative error
+    
+    ! Lazily computed columns z = L^-1 * e(p) of requested parameters p.
+    ! z is zero above row p, so only rows p..np are stored. The cache is
+    ! bounded to cov_cache_budget doubles; least recently used columns not
+    ! needed by the current request are evicted first.
+    type covariance_column_t
+        integer :: param = 0
+        integer :: last_used = 0
+        real(c_double), allocatable :: z(:)
+    end type covariance_column_t
+    
+    ! cov_slot(p) is the entry of p in cov_cache, 0 if not cached
+    integer, allocatable :: cov_slot(:)
+    type(covariance_column_t), allocatable :: cov_cache(:)
+    integer :: cov_clock = 0
+    integer(c_int64_t) :: cov_cache_size = 0, cov_cache_budget = 0
+    
+    ! Parameter number of x for each atom (y, z follow), 0 if XYZ fixed
+    integer, allocatable :: atom_xyz_param(:)
+    
+    ! Example reflection data (stands in for the SIR reflection arrays)
+    integer :: num_refl = 0
+    real(c_double) :: refl_stol_max = 0.0d0
+    real(c_double) :: refl_fo_max = 0.0d0
+    real(c_double), allocatable :: refl_fo(:), refl_sig(:), refl_stol(:), refl_fc(:)
+    
+    ! Statistics of the last refinement cycle
+    logical :: stat_valid = .false.
+    integer :: stat_cycle = 0
+    integer :: stat_num_zero_weight = 0  ! Left out of wR2/GooF, weight <= 0
+    integer :: stat_weight_scheme = 0    ! Scheme whose weights wR2/GooF used
+    integer :: stat_num_params = 0
+    real(c_double) :: stat_shell_sums(num_stat_sums, num_stat_bins) = 0.0d0
+    real(c_double) :: stat_fo_sums(num_stat_sums, num_stat_bins) = 0.0d0
+    
+    ! Overall figures of every cycle of the last run: (cycle, R1, wR2, GooF)
+    integer, parameter :: max_stat_history = 101  ! Cycle 0 (S.F.C.) or cycles 1..100
+    integer :: stat_num_history = 0
+    real(c_double) :: stat_history(4, max_stat_history) = 0.0d0
+    
 contains
     
     ! Subroutine to get initial LSQ parameters
-    subroutine lsq_get_parameters(refinement_type, damping_factor, reflections_cutoff, &
+    subroutine lsq_get_parameters(refinement_type, mixed_precision, damping_factor, reflections_cutoff, &
                                    num_cycles, weighting_scheme, weight_params, &
                                    refine_weight, num_observations, percent_observations, &
                                    num_parameters, ratio, num_weight_params, &
                                    all_weight_params, num_atoms, ier) bind(C, name="lsq_get_parameters")
         integer(c_int), intent(out) :: refinement_type
+        integer(c_int), intent(out) :: mixed_precision
         real(c_double), intent(out) :: damping_factor
         integer(c_int), intent(out) :: reflections_cutoff
         integer(c_int), intent(out) :: num_cycles
@@ -28,6 +113,7 @@ contains
         
         ! Set default/example parameters
         refinement_type = 0  ! 0=Diagonal, 1=FullMatrix, 2=SFCOnly
+        mixed_precision = 0  ! 0=double precision, 1=mixed precision (FullMatrix only)
         damping_factor = 0.7d0
         reflections_cutoff = 3
         num_cycles = 10
@@ -69,7 +155,7 @@ contains
         num_weight_params(13) = 4   ! Scheme 13: needs P(1), P(2), P(3), P(4)
         num_weight_params(14) = 3   ! Scheme 14: needs P(1), P(2), P(3)
         num_weight_params(15) = 3   ! Scheme 15: needs P(1), P(2), P(3)
-        num_weight_params(16) = 0   ! Scheme 16: complex, set to 0 for now
+        num_weight_params(16) = 10  ! Scheme 16: up to 10 Chebyshev coefficients a(1)..a(10)
         num_weight_params(17) = 3   ! Scheme 17: needs P(1), P(2), P(3)
         num_weight_params(18) = 5   ! Scheme 18: needs P(1), P(2), P(3), P(4), P(5)
         
@@ -128,7 +214,10 @@ contains
         all_weight_params(2, 15) = 0.5d0
         all_weight_params(3, 15) = 0.1d0
         
-        ! Scheme 16: no parameters for now
+        ! Scheme 16: W=Sc/(SUM(aj*Tj(F))j=1,n (trailing zero coefficients are unused)
+        all_weight_params(1, 16) = 1.0d0
+        all_weight_params(2, 16) = 0.5d0
+        all_weight_params(3, 16) = 0.2d0
         
         ! Scheme 17: W=Sc*(Sin(Th)/L)^P(3)/(P(1)*Sigma(Fo))^2+P(2)*Fo^2)
         all_weight_params(1, 17) = 1.0d0
@@ -153,11 +242,12 @@ contains
     end subroutine lsq_get_parameters
     
     ! Subroutine to execute LSQ calculation with given parameters
-    subroutine lsq_execute(refinement_type, damping_factor, reflections_cutoff, &
+    subroutine lsq_execute(refinement_type, mixed_precision, damping_factor, reflections_cutoff, &
                            num_cycles, weighting_scheme, weight_params, &
                            refine_weight, num_atoms, fix_xyz, fix_b, fix_occ, &
                            set_isotropic) bind(C, name="lsq_execute")
         integer(c_int), intent(in), value :: refinement_type
+        integer(c_int), intent(in), value :: mixed_precision
         real(c_double), intent(in), value :: damping_factor
         integer(c_int), intent(in), value :: reflections_cutoff
         integer(c_int), intent(in), value :: num_cycles
@@ -171,7 +261,7 @@ contains
         integer(c_int), intent(in) :: set_isotropic(*)
         
         character(len=20) :: ref_type_str
-        integer :: i
+        integer :: i, icycle
         
         ! Decode refinement type
         select case(refinement_type)
@@ -189,6 +279,9 @@ contains
         print *, "Fortran: Executing LSQ Refinement"
         print *, "========================================"
         print *, "Refinement Type: ", trim(ref_type_str)
+        if (refinement_type == 1) then
+            print *, "Mixed Precision Solve: ", mixed_precision == 1
+        end if
         print *, "Damping Factor: ", damping_factor
         print *, "Reflections Cutoff: ", reflections_cutoff
         print *, "Number of Cycles: ", num_cycles
@@ -218,46 +311,1311 @@ contains
         print *, "  Fix B         : ", count(fix_b(1:num_atoms) /= 0), " atoms"
         print *, "  Fix Occ.      : ", count(fix_occ(1:num_atoms) /= 0), " atoms"
         print *, "  Set Isotropic : ", count(set_isotropic(1:num_atoms) /= 0), " atoms"
+        print *, "========================================"
+        
+        ! Refined parameters: overall scale plus the free atomic parameters
+        if (allocated(atom_xyz_param)) deallocate(atom_xyz_param)
+        allocate(atom_xyz_param(num_atoms))
+        atom_xyz_param = 0
+        stat_num_params = 1
+        do i = 1, num_atoms
+            if (fix_xyz(i) == 0) then
+                atom_xyz_param(i) = stat_num_params + 1
+                stat_num_params = stat_num_params + 3
+            end if
+            if (fix_occ(i) == 0) stat_num_params = stat_num_params + 1
+            if (fix_b(i) == 0) then
+                if (set_isotropic(i) /= 0) then
+                    stat_num_params = stat_num_params + 1
+                else
+                    stat_num_params = stat_num_params + 6
+                end if
+            end if
+        end do
+        
+        if (.not. allocated(refl_fo)) call generate_example_reflections()
+        
+        ! Statistics and esds of a previous run no longer apply
+        stat_valid = .false.
+        stat_num_history = 0
+        call clear_covariance()
+        
+        ! Parameters of the selected scheme; Chebyshev coefficients in use
+        ! run up to the last non-zero one
+        weight_scheme = weighting_scheme
+        weight_coeffs = weight_params(1:max_weight_coeffs)
+        num_weight_coeffs = 0
+        do i = 1, max_weight_coeffs
+            if (weight_coeffs(i) /= 0.0d0) num_weight_coeffs = i
+        end do
+        weight_fit_coeffs = num_weight_coeffs
+        weights_refined = .false.
+        if (weight_scheme == chebyshev_scheme .and. num_weight_coeffs == 0) then
+            ! W=1/Sigma(Fo)^2 (scheme 5) is used until there are coefficients
+            if (refine_weight == 1) then
+                weight_fit_coeffs = 3  ! First fit is a quadratic
+                print *, "Fortran: no Chebyshev coefficients yet, cycle 1 uses W=1/Sigma(Fo)^2"
+            else
+                print *, "Fortran: no Chebyshev coefficients, using W=1/Sigma(Fo)^2"
+            end if
+        end if
+        
+        ! S.F.C. only computes structure factors once, without shifts
+        if (refinement_type == 2) then
+            call refine_cycle(0, damping_factor, reflections_cutoff)
+        else
+            do icycle = 1, num_cycles
+                call refine_cycle(icycle, damping_factor, reflections_cutoff)
+                
+                if (refinement_type == 1) then
+                    call full_matrix_cycle(reflections_cutoff, mixed_precision == 1)
+                end if
+                
+                ! Refit the Chebyshev weights to this cycle's residuals
+                if (weight_scheme == chebyshev_scheme .and. refine_weight == 1) then
+                    call fit_chebyshev_weights()
+                end if
+            end do
+        end if
+        
         print *, "========================================"
         print *, "Calculation completed successfully!"
         print *, "========================================"
         
     end subroutine lsq_execute
     
+    ! Subroutine to return the statistics of the last refinement cycle
+    ! bin_stats(:, k) = (lower Sin(Th)/L or Fo, upper, Nref, R1, wR2)
+    ! num_zero_weight = reflections left out of wR2 and GooF for a non-positive weight
+    ! weight_scheme = scheme (0-based) whose weights wR2 and GooF were computed with
+    subroutine lsq_get_statistics(max_bins, last_cycle, num_reflections, num_zero_weight, &
+                                  weight_scheme, r1, wr2, goof, &
+                                  num_shells, shell_stats, num_fo_bins, fo_bin_stats, &
+                                  ier) bind(C, name="lsq_get_statistics")
+        integer(c_int), intent(in), value :: max_bins
+        integer(c_int), intent(out) :: last_cycle
+        integer(c_int), intent(out) :: num_reflections
+        integer(c_int), intent(out) :: num_zero_weight
+        integer(c_int), intent(out) :: weight_scheme
+        real(c_double), intent(out) :: r1
+        real(c_double), intent(out) :: wr2
+        real(c_double), intent(out) :: goof
+        integer(c_int), intent(out) :: num_shells
+        real(c_double), intent(out) :: shell_stats(5, max_bins)
+        integer(c_int), intent(out) :: num_fo_bins
+        real(c_double), intent(out) :: fo_bin_stats(5, max_bins)
+        integer(c_int), intent(out) :: ier
+        
+        real(c_double) :: totals(num_stat_sums)
+        integer :: k, nbins
+        
+        last_cycle = stat_cycle
+        num_shells = 0
+        num_fo_bins = 0
+        num_reflections = 0
+        num_zero_weight = stat_num_zero_weight
+        weight_scheme = stat_weight_scheme
+        r1 = 0.0d0
+        wr2 = 0.0d0
+        goof = 0.0d0
+        
+        if (.not. stat_valid) then
+            ier = 1  ! No refinement has been run yet
+            return
+        end if
+        
+        ! Overall figures are the sum of the resolution shells
+        totals = sum(stat_shell_sums, dim=2)
+        num_reflections = nint(totals(1))
+        r1 = bin_r1(totals)
+        wr2 = bin_wr2(totals)
+        goof = bin_goof(totals)
+        
+        nbins = min(max_bins, num_stat_bins)
+        do k = 1, nbins
+            ! Shells have equal reciprocal-space volume
+            shell_stats(1, k) = refl_stol_max * (dble(k - 1) / num_stat_bins)**(1.0d0 / 3.0d0)
+            shell_stats(2, k) = refl_stol_max * (dble(k) / num_stat_bins)**(1.0d0 / 3.0d0)
+            shell_stats(3, k) = stat_shell_sums(1, k)
+            shell_stats(4, k) = bin_r1(stat_shell_sums(:, k))
+            shell_stats(5, k) = bin_wr2(stat_shell_sums(:, k))
+            
+            fo_bin_stats(1, k) = refl_fo_max * dble(k - 1) / num_stat_bins
+            fo_bin_stats(2, k) = refl_fo_max * dble(k) / num_stat_bins
+            fo_bin_stats(3, k) = stat_fo_sums(1, k)
+            fo_bin_stats(4, k) = bin_r1(stat_fo_sums(:, k))
+            fo_bin_stats(5, k) = bin_wr2(stat_fo_sums(:, k))
+        end do
+        num_shells = nbins
+        num_fo_bins = nbins
+        
+        ier = 0
+        
+    end subroutine lsq_get_statistics
+    
+    ! Subroutine to return R1, wR2 and GooF of every cycle of the last run
+    ! history(:, k) = (cycle, R1, wR2, GooF), k = 1..num_history
+    subroutine lsq_get_cycle_history(max_cycles, num_history, history, ier) &
+                                     bind(C, name="lsq_get_cycle_history")
+        integer(c_int), intent(in), value :: max_cycles
+        integer(c_int), intent(out) :: num_history
+        real(c_double), intent(out) :: history(4, max_cycles)
+        integer(c_int), intent(out) :: ier
+        
+        num_history = min(max_cycles, stat_num_history)
+        history(:, 1:num_history) = stat_history(:, 1:num_history)
+        ier = 0
+        if (num_history == 0) ier = 1  ! No refinement has been run yet
+        
+    end subroutine lsq_get_cycle_history
+    
+    ! Structure factor pass of one cycle. R1, wR2 and the binned sums are
+    ! reduced in the same (parallel) loop over the reflections, so the
+    ! statistics cost no extra pass over the reflection arrays.
+    subroutine refine_cycle(icycle, damping_factor, reflections_cutoff)
+        integer, intent(in) :: icycle
+        real(c_double), intent(in) :: damping_factor
+        integer, intent(in) :: reflections_cutoff
+        
+        real(c_double) :: shell_sums(num_stat_sums, num_stat_bins)
+        real(c_double) :: fo_sums(num_stat_sums, num_stat_bins)
+        real(c_double) :: fit_sums(3, num_weight_fit_bins)
+        real(c_double) :: fo, fc, fo2, w, delta2, misfit
+        real(c_double) :: x(weight_block), b0(weight_block), b1(weight_block), b2(weight_block)
+        real(c_double) :: wblk(weight_block)
+        logical :: use_chebyshev
+        real(c_double) :: totals(num_stat_sums)
+        integer :: i, k, m, first, ishell, ibin, ifit, num_zero_weight, scheme
+        
+        shell_sums = 0.0d0
+        fo_sums = 0.0d0
+        fit_sums = 0.0d0
+        num_zero_weight = 0
+        
+        ! Example model: the misfit left after each cycle shrinks by (1 - damping)
+        misfit = 0.3d0 * (1.0d0 - damping_factor)**icycle
+        use_chebyshev = (weight_scheme == chebyshev_scheme .and. num_weight_coeffs > 0)
+        ! Scheme 16 uses W=1/Sigma(Fo)^2 until it has coefficients
+        scheme = weight_scheme
+        if (scheme == chebyshev_scheme .and. .not. use_chebyshev) scheme = sigma_scheme
+        
+        !$omp parallel do private(fo, fc, fo2, w, delta2, x, b0, b1, b2, wblk, &
+        !$omp k, m, i, ishell, ibin, ifit) &
+        !$omp reduction(+:shell_sums, fo_sums, fit_sums, num_zero_weight)
+        do first = 1, num_refl, weight_block
+            m = min(weight_block, num_refl - first + 1)
+            
+            !$omp simd private(i)
+            do k = 1, m
+                i = first + k - 1
+                refl_fc(i) = refl_fo(i) * (1.0d0 + misfit * sin(1.7d0 * i) + 0.02d0 * cos(3.1d0 * i))
+            end do
+            
+            if (use_chebyshev) then
+                ! Scheme 16: W=1/SUM(aj*Tj(x)), x = Fo mapped onto [-1,1].
+                ! Clenshaw recurrence with the reflections innermost, so each
+                ! step is one vector operation over the block.
+                !$omp simd
+                do k = 1, m
+                    x(k) = max(-1.0d0, min(1.0d0, 2.0d0 * refl_fo(first + k - 1) / refl_fo_max - 1.0d0))
+                    b1(k) = 0.0d0
+                    b2(k) = 0.0d0
+                end do
+                do i = num_weight_coeffs, 2, -1
+                    !$omp simd
+                    do k = 1, m
+                        b0(k) = weight_coeffs(i) + 2.0d0 * x(k) * b1(k) - b2(k)
+                        b2(k) = b1(k)
+                        b1(k) = b0(k)
+                    end do
+                end do
+                !$omp simd
+                do k = 1, m
+                    b0(k) = weight_coeffs(1) + x(k) * b1(k) - b2(k)
+                    wblk(k) = merge(1.0d0 / max(b0(k), tiny(1.0d0)), 0.0d0, b0(k) > 0.0d0)
+                end do
+            else
+                do k = 1, m
+                    i = first + k - 1
+                    wblk(k) = scheme_weight(scheme, weight_coeffs, refl_fo(i), refl_sig(i), refl_stol(i))
+                end do
+            end if
+            
+            ! Scatter the block into the bins
+            do k = 1, m
+                i = first + k - 1
+                fo = refl_fo(i)
+                fc = refl_fc(i)
+                if (fo < reflections_cutoff * refl_sig(i)) cycle
+                
+                fo2 = fo * fo
+                delta2 = (fo2 - fc * fc)**2
+                w = wblk(k)
+                
+                ! Residuals for the Chebyshev weight fit (unweighted)
+                ifit = min(num_weight_fit_bins, 1 + int(num_weight_fit_bins * fo / refl_fo_max))
+                fit_sums(1, ifit) = fit_sums(1, ifit) + 1.0d0
+                fit_sums(2, ifit) = fit_sums(2, ifit) + fo
+                fit_sums(3, ifit) = fit_sums(3, ifit) + delta2
+                
+                ! R1 does not depend on the weights
+                ishell = min(num_stat_bins, 1 + int(num_stat_bins * (refl_stol(i) / refl_stol_max)**3))
+                ibin = min(num_stat_bins, 1 + int(num_stat_bins * fo / refl_fo_max))
+                
+                shell_sums(1, ishell) = shell_sums(1, ishell) + 1.0d0
+                shell_sums(2, ishell) = shell_sums(2, ishell) + fo
+                shell_sums(3, ishell) = shell_sums(3, ishell) + abs(fo - fc)
+                
+                fo_sums(1, ibin) = fo_sums(1, ibin) + 1.0d0
+                fo_sums(2, ibin) = fo_sums(2, ibin) + fo
+                fo_sums(3, ibin) = fo_sums(3, ibin) + abs(fo - fc)
+                
+                if (w <= 0.0d0) then
+                    ! No usable weight: leave the reflection out of wR2 and GooF
+                    num_zero_weight = num_zero_weight + 1
+                    cycle
+                end if
+                
+                shell_sums(4, ishell) = shell_sums(4, ishell) + w * delta2
+                shell_sums(5, ishell) = shell_sums(5, ishell) + w * fo2 * fo2
+                shell_sums(6, ishell) = shell_sums(6, ishell) + 1.0d0
+                
+                fo_sums(4, ibin) = fo_sums(4, ibin) + w * delta2
+                fo_sums(5, ibin) = fo_sums(5, ibin) + w * fo2 * fo2
+                fo_sums(6, ibin) = fo_sums(6, ibin) + 1.0d0
+            end do
+        end do
+        !$omp end parallel do
+        
+        stat_shell_sums = shell_sums
+        stat_fo_sums = fo_sums
+        weight_fit_sums = fit_sums
+        stat_num_zero_weight = num_zero_weight
+        stat_weight_scheme = scheme
+        stat_cycle = icycle
+        stat_valid = .true.
+        
+        totals = sum(shell_sums, dim=2)
+        if (stat_num_history < max_stat_history) then
+            stat_num_history = stat_num_history + 1
+            stat_history(:, stat_num_history) = (/ dble(icycle), bin_r1(totals), &
+                                                   bin_wr2(totals), bin_goof(totals) /)
+        end if
+        
+        print '(A,I3,A,F8.4,A,F8.4,A,I6)', " Cycle ", icycle, ": R1 = ", bin_r1(totals), &
+            ", wR2 = ", bin_wr2(totals), ", Nref = ", nint(totals(1))
+        if (num_zero_weight > 0) then
+            print '(A,I6,A)', " Warning: ", num_zero_weight, &
+                " reflections with weight <= 0 left out of wR2 and GooF"
+        end if
+        
+    end subroutine refine_cycle
+    
+    ! Full-matrix normal equations of one cycle, solved for the parameter shifts.
+    ! Mixed precision keeps only a single-precision packed triangle (half the
+    ! memory of the double one) and factorizes it in place. Double-precision
+    ! accuracy is recovered by iterative refinement: each step recomputes the
+    ! residual rhs - N*x in double from the reflections and solves for a
+    ! correction with the single-precision factor. A poor condition estimate,
+    ! a failed factorization or stalled refinement falls back to double.
+    subroutine full_matrix_cycle(reflections_cutoff, mixed_precision)
+        integer, intent(in) :: reflections_cutoff
+        logical, intent(in) :: mixed_precision
+        
+        real(c_float), allocatable :: nmat_sp(:)
+        real(c_double), allocatable :: nmat_dp(:)
+        real(c_double), allocatable :: rhs(:), scale(:), x(:), y(:), r(:), d(:)
+        real(c_double) :: anorm, cond_est, dy_max, dy_prev, rate, tol, chi2
+        integer :: np, i, j, step, info, nobs
+        logical :: converged
+        
+        np = stat_num_params
+        if (np <= 0) return
+        
+        allocate(rhs(np), scale(np), x(np), y(np), r(np), d(np))
+        call clear_covariance()
+        
+        if (mixed_precision) then
+            allocate(nmat_sp(int(np, c_int64_t) * (np + 1) / 2))
+            nmat_sp = 0.0
+            rhs = 0.0d0
+            chi2 = 0.0d0
+            nobs = 0
+            do i = 1, num_refl
+                if (refl_fo(i) < reflections_cutoff * refl_sig(i)) cycle
+                call example_derivatives(i, np, d)
+                rhs = rhs + d * (refl_fo(i) - refl_fc(i)) / refl_sig(i)**2
+                chi2 = chi2 + ((refl_fo(i) - refl_fc(i)) / refl_sig(i))**2
+                nobs = nobs + 1
+                call packed_rank1_sp(nmat_sp, np, real(d / refl_sig(i), c_float))
+            end do
+            
+            ! Scale to unit diagonal before factorizing
+            do j = 1, np
+                scale(j) = 1.0d0 / sqrt(max(dble(nmat_sp(packed_diag(j, np))), tiny(1.0d0)))
+            end do
+            call packed_scale_sp(nmat_sp, np, scale)
+            anorm = packed_norm1_sp(nmat_sp, np)
+            
+            call cholesky_packed_sp(nmat_sp, np, info)
+            cond_est = huge(1.0d0)
+            if (info == 0) cond_est = packed_cond_estimate_sp(nmat_sp, np, anorm)
+            
+            ! Attainable accuracy of the refined shifts is about cond*eps(double)
+            tol = max(1.0d-12, cond_est * epsilon(1.0d0))
+            dy_prev = huge(1.0d0)
+            
+            converged = .false.
+            if (info == 0 .and. cond_est <= mixed_cond_limit) then
+                y = scale * rhs
+                call cholesky_solve_packed_sp(nmat_sp, np, y)
+                do step = 1, max_refinement_steps
+                    ! r = rhs - N*x in double precision, streamed from the reflections
+                    x = scale * y
+                    r = rhs
+                    do i = 1, num_refl
+                        if (refl_fo(i) < reflections_cutoff * refl_sig(i)) cycle
+                        call example_derivatives(i, np, d)
+                        r = r - d * (dot_product(d, x) / refl_sig(i)**2)
+                    end do
+                    r = scale * r
+                    call cholesky_solve_packed_sp(nmat_sp, np, r)
+                    y = y + r
+                    dy_max = maxval(abs(r)) / max(maxval(abs(y)), tiny(1.0d0))
+                    ! Stop once the correction, or the error still left after
+                    ! the observed contraction rate, is below the tolerance
+                    rate = 0.5d0
+                    if (step > 1) rate = min(dy_max / dy_prev, 0.5d0)
+                    if (dy_max * min(1.0d0, rate / (1.0d0 - rate)) <= tol) then
+                        converged = .true.
+                        exit
+                    end if
+                    ! Stagnation: the corrections stopped shrinking, so the
+                    ! residual is at its rounding level. Accept if well below
+                    ! single precision, otherwise fall back to double.
+                    if (dy_max > 0.5d0 * dy_prev) then
+                        converged = (dy_max <= sqrt(epsilon(1.0d0)))
+                        exit
+                    end if
+                    dy_prev = dy_max
+                end do
+            end if
+            
+            if (converged) then
+                x = scale * y
+                print '(A,ES10.2,A,I2,A,ES10.3)', " Full matrix (mixed): cond est = ", cond_est, &
+                    ", refinement steps = ", step, ", max shift = ", maxval(abs(x))
+                call move_alloc(nmat_sp, cov_factor_sp)
+                call keep_covariance_factor(np, scale, chi2, nobs, anorm, cond_est)
+                return
+            end if
+            deallocate(nmat_sp)
+            print '(A,ES10.2,A)', " Full matrix (mixed): cond est = ", cond_est, &
+                ", falling back to double precision"
+        end if
+        
+        ! Double-precision accumulation and solve
+        allocate(nmat_dp(int(np, c_int64_t) * (np + 1) / 2))
+        nmat_dp = 0.0d0
+        rhs = 0.0d0
+        chi2 = 0.0d0
+        nobs = 0
+        do i = 1, num_refl
+            if (refl_fo(i) < reflections_cutoff * refl_sig(i)) cycle
+            call example_derivatives(i, np, d)
+            rhs = rhs + d * (refl_fo(i) - refl_fc(i)) / refl_sig(i)**2
+            chi2 = chi2 + ((refl_fo(i) - refl_fc(i)) / refl_sig(i))**2
+            nobs = nobs + 1
+            call packed_rank1_dp(nmat_dp, np, d / refl_sig(i))
+        end do
+        
+        do j = 1, np
+            scale(j) = 1.0d0 / sqrt(max(nmat_dp(packed_diag(j, np)), tiny(1.0d0)))
+        end do
+        call packed_scale_dp(nmat_dp, np, scale)
+        anorm = packed_norm1_dp(nmat_dp, np)
+        
+        call cholesky_packed_dp(nmat_dp, np, info)
+        if (info /= 0) then
+            print *, "Fortran: normal matrix is not positive definite (column ", info, ")"
+            return
+        end if
+        
+        y = scale * rhs
+        call cholesky_solve_packed_dp(nmat_dp, np, y)
+        x = scale * y
+        cond_est = packed_cond_estimate_dp(nmat_dp, np, anorm)
+        print '(A,ES10.2,A,ES10.3)', " Full matrix (double): cond est = ", &
+            cond_est, ", max shift = ", maxval(abs(x))
+        call move_alloc(nmat_dp, cov_factor_dp)
+        call keep_covariance_factor(np, scale, chi2, nobs, anorm, cond_est)
+        
+    end subroutine full_matrix_cycle
+    
+    ! Subroutine to return a block of the covariance matrix of the last
+    ! full-matrix cycle: cov(a,b) = Cov(p(indices(a)), p(indices(b))).
+    ! Only the requested columns of the inverse are formed (and cached), so
+    ! repeated requests (per-atom blocks, pairs for geometry) stay cheap.
+    ! ier: 1 = no full-matrix factor available, 2 = parameter out of range
+    subroutine lsq_get_covariance(num_indices, indices, cov, ier) bind(C, name="lsq_get_covariance")
+        integer(c_int), intent(in), value :: num_indices
+        integer(c_int), intent(in) :: indices(num_indices)
+        real(c_double), intent(out) :: cov(num_indices, num_indices)
+        integer(c_int), intent(out) :: ier
+        
+        integer :: a, b, p, q, sa, sb, first
+        
+        cov = 0.0d0
+        if (cov_np == 0) then
+            ier = 1
+            return
+        end if
+        if (any(indices < 1) .or. any(indices > cov_np)) then
+            ier = 2
+            return
+        end if
+        
+        ! A new stamp pins the columns of this request against eviction
+        cov_clock = cov_clock + 1
+        do a = 1, num_indices
+            sa = covariance_column(indices(a))
+        end do
+        
+        ! Cov(p,q) = s(p)*s(q)*(z(p).z(q))*S^2; z(p) is stored from row p
+        do a = 1, num_indices
+            p = indices(a)
+            sa = cov_slot(p)
+            do b = 1, a
+                q = indices(b)
+                sb = cov_slot(q)
+                first = max(p, q)
+                cov(a, b) = cov_scale(p) * cov_scale(q) * cov_variance_scale &
+                          * dot_product(cov_cache(sa)%z(first-p+1:cov_np-p+1), &
+                                        cov_cache(sb)%z(first-q+1:cov_np-q+1))
+                cov(b, a) = cov(a, b)
+            end do
+        end do
+        
+        ier = 0
+        
+    end subroutine lsq_get_covariance
+    
+    ! Subroutine to return the covariance of the x, y, z of a list of atoms
+    ! (1-based), as needed for bond length and angle esds:
+    ! cov(3*(a-1)+i, 3*(b-1)+j) = Cov(coordinate i of atoms(a), coordinate j of atoms(b))
+    ! ier: 1 = no full-matrix factor available, 2 = no such atom, 3 = XYZ fixed
+    subroutine lsq_get_atoms_covariance(num_atoms, atoms, cov, ier) &
+            bind(C, name="lsq_get_atoms_covariance")
+        integer(c_int), intent(in), value :: num_atoms
+        integer(c_int), intent(in) :: atoms(num_atoms)
+        real(c_double), intent(out) :: cov(3 * num_atoms, 3 * num_atoms)
+        integer(c_int), intent(out) :: ier
+        
+        integer(c_int) :: indices(3 * num_atoms)
+        integer :: a
+        
+        cov = 0.0d0
+        if (cov_np == 0) then
+            ier = 1
+            return
+        end if
+        if (.not. allocated(atom_xyz_param)) then
+            ier = 2
+            return
+        end if
+        do a = 1, num_atoms
+            if (atoms(a) < 1 .or. atoms(a) > size(atom_xyz_param)) then
+                ier = 2
+                return
+            end if
+            if (atom_xyz_param(atoms(a)) == 0) then
+                ier = 3
+                return
+            end if
+            indices(3*a-2:3*a) = atom_xyz_param(atoms(a)) + (/0, 1, 2/)
+        end do
+        
+        call lsq_get_covariance(3 * num_atoms, indices, cov, ier)
+        
+    end subroutine lsq_get_atoms_covariance
+    
+    ! Subroutine to return the esds of the x, y, z of one atom (1-based).
+    ! rel_error is a worst-case bound on their relative error from rounding
+    ! in the normal matrix and its factor (1 = no accuracy can be claimed).
+    ! ier: as lsq_get_atoms_covariance
+    subroutine lsq_get_atom_esds(atom, esd_xyz, rel_error, single_precision, ier) &
+            bind(C, name="lsq_get_atom_esds")
+        integer(c_int), intent(in), value :: atom
+        real(c_double), intent(out) :: esd_xyz(3)
+        real(c_double), intent(out) :: rel_error
+        integer(c_int), intent(out) :: single_precision
+        integer(c_int), intent(out) :: ier
+        
+        real(c_double) :: cov(3, 3)
+        integer :: k
+        
+        esd_xyz = 0.0d0
+        rel_error = 0.0d0
+        single_precision = 0
+        
+        call lsq_get_atoms_covariance(1, (/atom/), cov, ier)
+        if (ier /= 0) return
+        do k = 1, 3
+            esd_xyz(k) = sqrt(max(cov(k, k), 0.0d0))
+        end do
+        rel_error = cov_esd_error
+        if (allocated(cov_factor_sp)) single_precision = 1
+        
+    end subroutine lsq_get_atom_esds
+    
+    ! Keep the factor just moved into cov_factor_sp/dp for esd requests;
+    ! S^2 = Chi^2/(Nobs-Npar) scales the inverse normal matrix
+    subroutine keep_covariance_factor(np, scale, chi2, nobs, anorm, cond_est)
+        integer, intent(in) :: np
+        real(c_double), intent(in) :: scale(np)
+        real(c_double), intent(in) :: chi2
+        integer, intent(in) :: nobs
+        real(c_double), intent(in) :: anorm, cond_est
+        real(c_double) :: eps, delta
+        
+        cov_np = np
+        cov_scale = scale
+        cov_variance_scale = 1.0d0
+        if (nobs > np) cov_variance_scale = chi2 / dble(nobs - np)
+        
+        ! First-order bound on the esds' relative error. Summing Nobs terms
+        ! into the unit-diagonal A and factorizing it perturb each entry by at
+        ! most (Nobs+np+2)*eps, so ||dA||_1 <= np*(Nobs+np+2)*eps. A variance
+        ! v = e^T*A^-1*e then changes by at most ||dA||*||A^-1||*v, and an
+        ! esd by half that. eps is that of the precision A was summed in.
+        eps = epsilon(1.0d0)
+        if (allocated(cov_factor_sp)) eps = epsilon(1.0)
+        delta = np * (dble(nobs) + np + 2) * eps * (cond_est / anorm)
+        cov_esd_error = 1.0d0
+        if (delta < 0.5d0) cov_esd_error = min(1.0d0, 0.5d0 * delta / (1.0d0 - delta))
+        allocate(cov_slot(np))
+        cov_slot = 0
+        ! Cached columns may take np*(np+1)/8 doubles, half the bytes of the
+        ! single-precision factor (a quarter of the double one), and at least
+        ! 4 full columns so one atom's x, y, z always fit
+        cov_cache_budget = max(int(np, c_int64_t) * (np + 1) / 8, 4 * int(np, c_int64_t))
+    end subroutine keep_covariance_factor
+    
+    ! Drop the kept factor and the cached columns
+    subroutine clear_covariance()
+        cov_np = 0
+        cov_cache_size = 0
+        cov_cache_budget = 0
+        if (allocated(cov_factor_sp)) deallocate(cov_factor_sp)
+        if (allocated(cov_factor_dp)) deallocate(cov_factor_dp)
+        if (allocated(cov_scale)) deallocate(cov_scale)
+        if (allocated(cov_slot)) deallocate(cov_slot)
+        if (allocated(cov_cache)) deallocate(cov_cache)
+    end subroutine clear_covariance
+    
+    ! Entry in cov_cache of z = L^-1 * e(p), computing it on first use
+    ! (forward substitution from row p: O((np-p)^2) instead of a full inverse)
+    function covariance_column(p) result(slot)
+        integer, intent(in) :: p
+        integer :: slot
+        type(covariance_column_t), allocatable :: grown(:)
+        integer :: j, m, oldest
+        integer(c_int64_t) :: kj
+        
+        slot = cov_slot(p)
+        if (slot /= 0) then
+            cov_cache(slot)%last_used = cov_clock
+            return
+        end if
+        m = cov_np - p + 1
+        if (.not. allocated(cov_cache)) allocate(cov_cache(min(16, cov_np)))
+        
+        ! Evict least recently used columns until the new one fits; columns
+        ! stamped with the current request are kept even over budget
+        do while (cov_cache_size + m > cov_cache_budget)
+            oldest = 0
+            do j = 1, size(cov_cache)
+                if (cov_cache(j)%param == 0 .or. cov_cache(j)%last_used == cov_clock) cycle
+                if (oldest == 0) then
+                    oldest = j
+                else if (cov_cache(j)%last_used < cov_cache(oldest)%last_used) then
+                    oldest = j
+                end if
+            end do
+            if (oldest == 0) exit
+            cov_slot(cov_cache(oldest)%param) = 0
+            cov_cache_size = cov_cache_size - size(cov_cache(oldest)%z)
+            cov_cache(oldest)%param = 0
+            deallocate(cov_cache(oldest)%z)
+        end do
+        
+        ! Reuse a free entry, or grow the table geometrically
+        slot = 0
+        do j = 1, size(cov_cache)
+            if (cov_cache(j)%param == 0) then
+                slot = j
+                exit
+            end if
+        end do
+        if (slot == 0) then
+            slot = size(cov_cache) + 1
+            allocate(grown(min(2 * size(cov_cache), cov_np)))
+            grown(1:size(cov_cache)) = cov_cache
+            call move_alloc(grown, cov_cache)
+        end if
+        
+        cov_slot(p) = slot
+        cov_cache(slot)%param = p
+        cov_cache(slot)%last_used = cov_clock
+        cov_cache_size = cov_cache_size + m
+        allocate(cov_cache(slot)%z(m))
+        
+        ! z(j) holds row p+j-1
+        associate (z => cov_cache(slot)%z)
+            z = 0.0d0
+            z(1) = 1.0d0
+            do j = 1, m
+                kj = packed_diag(p + j - 1, cov_np)
+                if (allocated(cov_factor_sp)) then
+                    z(j) = z(j) / cov_factor_sp(kj)
+                    z(j+1:m) = z(j+1:m) - z(j) * cov_factor_sp(kj+1:kj+m-j)
+                else
+                    z(j) = z(j) / cov_factor_dp(kj)
+                    z(j+1:m) = z(j+1:m) - z(j) * cov_factor_dp(kj+1:kj+m-j)
+                end if
+            end do
+        end associate
+    end function covariance_column
+    
+    ! Example derivatives dFc/dp(j) of reflection i (stand-in for the SIR ones)
+    pure subroutine example_derivatives(i, np, d)
+        integer, intent(in) :: i, np
+        real(c_double), intent(out) :: d(np)
+        integer :: j
+        
+        d(1) = refl_fc(i)  ! Overall scale
+        do j = 2, np
+            d(j) = refl_fo(i) * cos(0.37d0 * i * j + 0.11d0 * j) &
+                 * exp(-refl_stol(i)**2 * mod(j, 7))
+        end do
+    end subroutine example_derivatives
+    
+    ! Position of (j,j) in a lower triangle packed by columns
+    ! (64-bit: the offset overflows a default integer beyond about n = 46000)
+    pure function packed_diag(j, n) result(k)
+        integer, intent(in) :: j, n
+        integer(c_int64_t) :: k
+        k = (int(j, c_int64_t) - 1) * (2 * int(n, c_int64_t) - j + 2) / 2 + 1
+    end function packed_diag
+    
+    ! Packed lower-triangle kernels. The _sp and _dp versions are identical
+    ! apart from the storage kind of the matrix.
+    
+    ! A = A + v*v^T
+    subroutine packed_rank1_sp(ap, n, v)
+        real(c_float), intent(inout) :: ap(*)
+        integer, intent(in) :: n
+        real(c_float), intent(in) :: v(n)
+        integer :: j
+        integer(c_int64_t) :: k
+        do j = 1, n
+            k = packed_diag(j, n)
+            ap(k:k+n-j) = ap(k:k+n-j) + v(j) * v(j:n)
+        end do
+    end subroutine packed_rank1_sp
+    
+    subroutine packed_rank1_dp(ap, n, v)
+        real(c_double), intent(inout) :: ap(*)
+        integer, intent(in) :: n
+        real(c_double), intent(in) :: v(n)
+        integer :: j
+        integer(c_int64_t) :: k
+        do j = 1, n
+            k = packed_diag(j, n)
+            ap(k:k+n-j) = ap(k:k+n-j) + v(j) * v(j:n)
+        end do
+    end subroutine packed_rank1_dp
+    
+    ! A = S*A*S, S = diag(s)
+    subroutine packed_scale_sp(ap, n, s)
+        real(c_float), intent(inout) :: ap(*)
+        integer, intent(in) :: n
+        real(c_double), intent(in) :: s(n)
+        integer :: j
+        integer(c_int64_t) :: k
+        do j = 1, n
+            k = packed_diag(j, n)
+            ap(k:k+n-j) = real(ap(k:k+n-j) * s(j) * s(j:n), c_float)
+        end do
+    end subroutine packed_scale_sp
+    
+    subroutine packed_scale_dp(ap, n, s)
+        real(c_double), intent(inout) :: ap(*)
+        integer, intent(in) :: n
+        real(c_double), intent(in) :: s(n)
+        integer :: j
+        integer(c_int64_t) :: k
+        do j = 1, n
+            k = packed_diag(j, n)
+            ap(k:k+n-j) = ap(k:k+n-j) * s(j) * s(j:n)
+        end do
+    end subroutine packed_scale_dp
+    
+    ! In-place right-looking Cholesky A = L*L^T; info = failing column or 0
+    subroutine cholesky_packed_sp(ap, n, info)
+        real(c_float), intent(inout) :: ap(*)
+        integer, intent(in) :: n
+        integer, intent(out) :: info
+        integer :: j, k
+        integer(c_int64_t) :: kj, kk
+        
+        info = 0
+        do j = 1, n
+            kj = packed_diag(j, n)
+            if (ap(kj) <= 0.0) then
+                info = j
+                return
+            end if
+            ap(kj) = sqrt(ap(kj))
+            ap(kj+1:kj+n-j) = ap(kj+1:kj+n-j) / ap(kj)
+            do k = j + 1, n
+                kk = packed_diag(k, n)
+                ap(kk:kk+n-k) = ap(kk:kk+n-k) - ap(kj+k-j) * ap(kj+k-j:kj+n-j)
+            end do
+        end do
+    end subroutine cholesky_packed_sp
+    
+    subroutine cholesky_packed_dp(ap, n, info)
+        real(c_double), intent(inout) :: ap(*)
+        integer, intent(in) :: n
+        integer, intent(out) :: info
+        integer :: j, k
+        integer(c_int64_t) :: kj, kk
+        
+        info = 0
+        do j = 1, n
+            kj = packed_diag(j, n)
+            if (ap(kj) <= 0.0d0) then
+                info = j
+                return
+            end if
+            ap(kj) = sqrt(ap(kj))
+            ap(kj+1:kj+n-j) = ap(kj+1:kj+n-j) / ap(kj)
+            do k = j + 1, n
+                kk = packed_diag(k, n)
+                ap(kk:kk+n-k) = ap(kk:kk+n-k) - ap(kj+k-j) * ap(kj+k-j:kj+n-j)
+            end do
+        end do
+    end subroutine cholesky_packed_dp
+    
+    ! Solve L*L^T*x = b in place; the sums are carried in double precision
+    subroutine cholesky_solve_packed_sp(lp, n, b)
+        real(c_float), intent(in) :: lp(*)
+        integer, intent(in) :: n
+        real(c_double), intent(inout) :: b(n)
+        integer :: j
+        integer(c_int64_t) :: kj
+        
+        do j = 1, n
+            kj = packed_diag(j, n)
+            b(j) = b(j) / lp(kj)
+            b(j+1:n) = b(j+1:n) - b(j) * lp(kj+1:kj+n-j)
+        end do
+        do j = n, 1, -1
+            kj = packed_diag(j, n)
+            b(j) = (b(j) - dot_product(dble(lp(kj+1:kj+n-j)), b(j+1:n))) / lp(kj)
+        end do
+    end subroutine cholesky_solve_packed_sp
+    
+    subroutine cholesky_solve_packed_dp(lp, n, b)
+        real(c_double), intent(in) :: lp(*)
+        integer, intent(in) :: n
+        real(c_double), intent(inout) :: b(n)
+        integer :: j
+        integer(c_int64_t) :: kj
+        
+        do j = 1, n
+            kj = packed_diag(j, n)
+            b(j) = b(j) / lp(kj)
+            b(j+1:n) = b(j+1:n) - b(j) * lp(kj+1:kj+n-j)
+        end do
+        do j = n, 1, -1
+            kj = packed_diag(j, n)
+            b(j) = (b(j) - dot_product(lp(kj+1:kj+n-j), b(j+1:n))) / lp(kj)
+        end do
+    end subroutine cholesky_solve_packed_dp
+    
+    ! 1-norm of a symmetric matrix stored as its packed lower triangle
+    function packed_norm1_sp(ap, n) result(anorm)
+        real(c_float), intent(in) :: ap(*)
+        integer, intent(in) :: n
+        real(c_double) :: anorm
+        real(c_double) :: colsum(n)
+        integer :: j
+        integer(c_int64_t) :: kj
+        
+        ! Column j of the triangle holds A(j:n,j), which is also A(j,j:n)
+        colsum = 0.0d0
+        do j = 1, n
+            kj = packed_diag(j, n)
+            colsum(j) = colsum(j) + sum(abs(dble(ap(kj:kj+n-j))))
+            colsum(j+1:n) = colsum(j+1:n) + abs(dble(ap(kj+1:kj+n-j)))
+        end do
+        anorm = maxval(colsum)
+    end function packed_norm1_sp
+    
+    function packed_norm1_dp(ap, n) result(anorm)
+        real(c_double), intent(in) :: ap(*)
+        integer, intent(in) :: n
+        real(c_double) :: anorm
+        real(c_double) :: colsum(n)
+        integer :: j
+        integer(c_int64_t) :: kj
+        
+        ! Column j of the triangle holds A(j:n,j), which is also A(j,j:n)
+        colsum = 0.0d0
+        do j = 1, n
+            kj = packed_diag(j, n)
+            colsum(j) = colsum(j) + sum(abs(ap(kj:kj+n-j)))
+            colsum(j+1:n) = colsum(j+1:n) + abs(ap(kj+1:kj+n-j))
+        end do
+        anorm = maxval(colsum)
+    end function packed_norm1_dp
+    
+    ! 1-norm condition number ||A||_1*||A^-1||_1 of the matrix factorized in
+    ! lp, anorm = ||A||_1 taken before factorizing. ||A^-1||_1 is estimated
+    ! as in LAPACK xLACON (Hager, Higham): a few solves with the factor and
+    ! no extra O(n^2) storage. A is symmetric, so A^-T solves are A^-1 solves.
+    function packed_cond_estimate_sp(lp, n, anorm) result(c)
+        real(c_float), intent(in) :: lp(*)
+        integer, intent(in) :: n
+        real(c_double), intent(in) :: anorm
+        real(c_double) :: c
+        real(c_double) :: x(n), z(n), est
+        integer :: iter, j, jprev
+        
+        est = 0.0d0
+        jprev = 0
+        x = 1.0d0 / n
+        do iter = 1, 5
+            call cholesky_solve_packed_sp(lp, n, x)
+            if (sum(abs(x)) <= est) exit
+            est = sum(abs(x))
+            z = sign(1.0d0, x)
+            call cholesky_solve_packed_sp(lp, n, z)
+            j = maxloc(abs(z), 1)
+            ! z(jprev) = z^T*x for the unit vector x = e(jprev) just used
+            if (jprev > 0) then
+                if (abs(z(j)) <= z(jprev)) exit
+            end if
+            x = 0.0d0
+            x(j) = 1.0d0
+            jprev = j
+        end do
+        
+        ! Higham's alternating-sign vector catches matrices the iteration misses
+        do j = 1, n
+            x(j) = merge(1.0d0, -1.0d0, mod(j, 2) == 1) * (1.0d0 + dble(j - 1) / max(n - 1, 1))
+        end do
+        call cholesky_solve_packed_sp(lp, n, x)
+        est = max(est, 2.0d0 * sum(abs(x)) / (3.0d0 * n))
+        
+        c = anorm * est
+    end function packed_cond_estimate_sp
+    
+    function packed_cond_estimate_dp(lp, n, anorm) result(c)
+        real(c_double), intent(in) :: lp(*)
+        integer, intent(in) :: n
+        real(c_double), intent(in) :: anorm
+        real(c_double) :: c
+        real(c_double) :: x(n), z(n), est
+        integer :: iter, j, jprev
+        
+        est = 0.0d0
+        jprev = 0
+        x = 1.0d0 / n
+        do iter = 1, 5
+            call cholesky_solve_packed_dp(lp, n, x)
+            if (sum(abs(x)) <= est) exit
+            est = sum(abs(x))
+            z = sign(1.0d0, x)
+            call cholesky_solve_packed_dp(lp, n, z)
+            j = maxloc(abs(z), 1)
+            ! z(jprev) = z^T*x for the unit vector x = e(jprev) just used
+            if (jprev > 0) then
+                if (abs(z(j)) <= z(jprev)) exit
+            end if
+            x = 0.0d0
+            x(j) = 1.0d0
+            jprev = j
+        end do
+        
+        ! Higham's alternating-sign vector catches matrices the iteration misses
+        do j = 1, n
+            x(j) = merge(1.0d0, -1.0d0, mod(j, 2) == 1) * (1.0d0 + dble(j - 1) / max(n - 1, 1))
+        end do
+        call cholesky_solve_packed_dp(lp, n, x)
+        est = max(est, 2.0d0 * sum(abs(x)) / (3.0d0 * n))
+        
+        c = anorm * est
+    end function packed_cond_estimate_dp
+    
+    ! Generate an example reflection set (Fo, Sigma(Fo), Sin(Th)/L)
+    subroutine generate_example_reflections()
+        integer :: i
+        
+        num_refl = 1234
+        refl_stol_max = 0.6d0
+        allocate(refl_fo(num_refl), refl_sig(num_refl), refl_stol(num_refl), refl_fc(num_refl))
+        
+        do i = 1, num_refl
+            refl_stol(i) = refl_stol_max * (dble(i) / num_refl)**(1.0d0 / 3.0d0)
+            refl_fo(i) = 200.0d0 * exp(-3.0d0 * refl_stol(i)**2) * (0.2d0 + abs(sin(2.3d0 * i)))
+            refl_sig(i) = 0.5d0 + 0.03d0 * refl_fo(i)
+        end do
+        refl_fc = 0.0d0
+        refl_fo_max = maxval(refl_fo)
+        
+    end subroutine generate_example_reflections
+    
+    ! Sum of a(j)*T(j-1)(x), j=1,n, by the Clenshaw recurrence (no cosines,
+    ! 2n flops per reflection: the same cost as a polynomial in Fo)
+    pure function chebyshev_sum(x, a, n) result(t)
+        real(c_double), intent(in) :: x
+        real(c_double), intent(in) :: a(*)
+        integer, intent(in) :: n
+        real(c_double) :: t
+        real(c_double) :: b0, b1, b2, xx
+        integer :: k
+        
+        t = 0.0d0
+        if (n <= 0) return
+        
+        xx = max(-1.0d0, min(1.0d0, x))
+        b1 = 0.0d0
+        b2 = 0.0d0
+        do k = n, 2, -1
+            b0 = a(k) + 2.0d0 * xx * b1 - b2
+            b2 = b1
+            b1 = b0
+        end do
+        t = a(1) + xx * b1 - b2
+    end function chebyshev_sum
+    
+    ! Least-squares fit of the Chebyshev coefficients to the binned residuals:
+    ! SUM(aj*Tj(x_bin)) ~ <(Fo^2-Fc^2)^2>_bin, each bin weighted by Nref/<..>^2
+    ! (relative residuals, as the mean residual spans orders of magnitude).
+    ! Works on the fit bins of the last cycle, so it never touches the
+    ! reflection arrays. A fit that is not positive over all of [-1,1] is
+    ! damped towards the previous coefficients, then towards the constant
+    ! fit, and rejected if damping does not help.
+    subroutine fit_chebyshev_weights()
+        real(c_double) :: a(max_weight_coeffs, max_weight_coeffs)
+        real(c_double) :: rhs(max_weight_coeffs)
+        real(c_double) :: tk(max_weight_coeffs)
+        real(c_double) :: trial(max_weight_coeffs)
+        real(c_double) :: base(max_weight_coeffs)
+        real(c_double) :: x, y, nref, bin_weight, sum_weight, sum_y, damping
+        integer :: k, j, l, n, num_bins_used, info, ntrial, nbase, iref
+        
+        num_bins_used = count(weight_fit_sums(1, :) > 0.0d0)
+        n = min(weight_fit_coeffs, num_bins_used / min_bins_per_coeff)
+        if (n <= 0) then
+            print *, "Fortran: too few populated Fo bins for a Chebyshev weight fit"
+            return
+        end if
+        
+        a = 0.0d0
+        rhs = 0.0d0
+        sum_weight = 0.0d0
+        sum_y = 0.0d0
+        do k = 1, num_weight_fit_bins
+            nref = weight_fit_sums(1, k)
+            if (nref <= 0.0d0 .or. weight_fit_sums(3, k) <= 0.0d0) cycle
+            
+            ! Mean Fo of the bin mapped onto [-1,1], and mean squared residual
+            x = 2.0d0 * (weight_fit_sums(2, k) / nref) / refl_fo_max - 1.0d0
+            y = weight_fit_sums(3, k) / nref
+            bin_weight = nref / (y * y)
+            sum_weight = sum_weight + bin_weight
+            sum_y = sum_y + bin_weight * y
+            
+            ! T0..T(n-1) at x by the three-term recurrence
+            tk(1) = 1.0d0
+            if (n > 1) tk(2) = x
+            do j = 3, n
+                tk(j) = 2.0d0 * x * tk(j - 1) - tk(j - 2)
+            end do
+            
+            do j = 1, n
+                rhs(j) = rhs(j) + bin_weight * tk(j) * y
+                do l = 1, j
+                    a(j, l) = a(j, l) + bin_weight * tk(j) * tk(l)
+                end do
+            end do
+        end do
+        if (sum_weight <= 0.0d0) return
+        
+        call cholesky_solve(a, rhs, n, max_weight_coeffs, info)
+        if (info /= 0) then
+            print *, "Fortran: Chebyshev weight fit is singular, coefficients kept"
+            return
+        end if
+        
+        trial = 0.0d0
+        trial(1:n) = rhs(1:n)
+        ntrial = n
+        
+        ! Halve the step from a positive reference until the weights are
+        ! positive everywhere on [-1,1]. References: the previous coefficients,
+        ! then the constant (weighted mean residual) fit.
+        damping = 1.0d0
+        do iref = 1, 2
+            if (chebyshev_positive(trial, ntrial)) exit
+            if (iref == 1) then
+                if (.not. chebyshev_positive(weight_coeffs, num_weight_coeffs)) cycle
+                base = weight_coeffs
+                nbase = num_weight_coeffs
+            else
+                base = 0.0d0
+                base(1) = sum_y / sum_weight
+                nbase = 1
+            end if
+            
+            damping = 1.0d0
+            do while (damping >= 0.1d0)
+                damping = 0.5d0 * damping
+                ntrial = max(n, nbase)
+                trial = (1.0d0 - damping) * base
+                trial(1:n) = trial(1:n) + damping * rhs(1:n)
+                if (chebyshev_positive(trial, ntrial)) exit
+            end do
+        end do
+        
+        if (.not. chebyshev_positive(trial, ntrial)) then
+            print *, "Fortran: Chebyshev weight fit is not positive on [-1,1], coefficients kept"
+            return
+        end if
+        
+        weight_coeffs = trial
+        num_weight_coeffs = ntrial
+        weights_refined = .true.
+        if (damping < 1.0d0) then
+            print '(A,F6.3)', " Chebyshev fit damped to keep weights positive, step = ", damping
+        end if
+        print '(A,10ES11.3)', " Chebyshev coefficients: ", weight_coeffs(1:num_weight_coeffs)
+        
+    end subroutine fit_chebyshev_weights
+    
+    ! True if SUM(aj*Tj(x)) > 0 on a fine grid over [-1,1]
+    pure function chebyshev_positive(a, n) result(ok)
+        real(c_double), intent(in) :: a(*)
+        integer, intent(in) :: n
+        logical :: ok
+        integer :: k
+        
+        ok = .false.
+        if (n <= 0) return
+        do k = 0, 200
+            if (chebyshev_sum(-1.0d0 + k / 100.0d0, a, n) <= 0.0d0) return
+        end do
+        ok = .true.
+    end function chebyshev_positive
+    
+    ! Subroutine to return the Chebyshev coefficients refined by the last run
+    ! ier: 1 = the last run did not refine scheme 16 weights
+    subroutine lsq_get_weight_params(weight_params, num_params, ier) &
+                                     bind(C, name="lsq_get_weight_params")
+        real(c_double), intent(out) :: weight_params(max_weight_coeffs)
+        integer(c_int), intent(out) :: num_params
+        integer(c_int), intent(out) :: ier
+        
+        weight_params = weight_coeffs
+        num_params = num_weight_coeffs
+        ier = 0
+        if (.not. weights_refined) ier = 1
+        
+    end subroutine lsq_get_weight_params
+    
+    ! Solve A*x = b in place for a small symmetric positive definite A
+    ! (lower triangle used). b is overwritten by x; info /= 0 if A is not SPD.
+    subroutine cholesky_solve(a, b, n, lda, info)
+        integer, intent(in) :: n, lda
+        real(c_double), intent(inout) :: a(lda, *)
+        real(c_double), intent(inout) :: b(*)
+        integer, intent(out) :: info
+        integer :: j, k
+        
+        info = 0
+        do j = 1, n
+            a(j, j) = a(j, j) - sum(a(j, 1:j-1)**2)
+            if (a(j, j) <= 0.0d0) then
+                info = j
+                return
+            end if
+            a(j, j) = sqrt(a(j, j))
+            do k = j + 1, n
+                a(k, j) = (a(k, j) - sum(a(k, 1:j-1) * a(j, 1:j-1))) / a(j, j)
+            end do
+        end do
+        
+        ! Forward (L*y = b) and back (L^T*x = y) substitution
+        do j = 1, n
+            b(j) = (b(j) - sum(a(j, 1:j-1) * b(1:j-1))) / a(j, j)
+        end do
+        do j = n, 1, -1
+            b(j) = (b(j) - sum(a(j+1:n, j) * b(j+1:n))) / a(j, j)
+        end do
+    end subroutine cholesky_solve
+    
+    ! R1 = Sum||Fo|-|Fc|| / Sum|Fo| of one set of bin sums
+    pure function bin_r1(sums) result(r)
+        real(c_double), intent(in) :: sums(num_stat_sums)
+        real(c_double) :: r
+        r = 0.0d0
+        if (sums(2) > 0.0d0) r = sums(3) / sums(2)
+    end function bin_r1
+    
+    ! GooF = Sqrt(Sum w*(Fo^2-Fc^2)^2 / (Nref - Npar)) of one set of bin sums,
+    ! Nref counting only reflections with a positive weight
+    function bin_goof(sums) result(r)
+        real(c_double), intent(in) :: sums(num_stat_sums)
+        real(c_double) :: r
+        r = 0.0d0
+        if (sums(6) > stat_num_params) r = sqrt(sums(4) / (sums(6) - stat_num_params))
+    end function bin_goof
+    
+    ! wR2 = Sqrt(Sum w*(Fo^2-Fc^2)^2 / Sum w*(Fo^2)^2) of one set of bin sums
+    pure function bin_wr2(sums) result(r)
+        real(c_double), intent(in) :: sums(num_stat_sums)
+        real(c_double) :: r
+        r = 0.0d0
+        if (sums(5) > 0.0d0) r = sqrt(sums(4) / sums(5))
+    end function bin_wr2
+    
+    ! Weight of one reflection under weighting scheme (0-based combo index)
+    ! with parameters p, Sc = 1. The schemes weight |Fo|; wR2 and GooF are
+    ! on Fo^2, so W is converted with Sigma(Fo^2) = 2*Fo*Sigma(Fo), which
+    ! makes scheme 5 W=1/Sigma(Fo^2)^2. Returns 0 where the formula has no
+    ! positive finite value. Scheme 16 (Chebyshev) is evaluated by the caller.
+    pure function scheme_weight(scheme, p, fo, sig, stol) result(w)
+        integer, intent(in) :: scheme
+        real(c_double), intent(in) :: p(max_weight_coeffs)
+        real(c_double), intent(in) :: fo, sig, stol
+        real(c_double) :: w
+        
+        w = 0.0d0
+        if (fo <= 0.0d0) return
+        
+        select case (scheme + 1)
+            case (1)
+                if (p(1) <= 0.0d0) return
+                w = fo / p(1)
+                if (fo < p(1)) w = 1.0d0 / w
+            case (2)
+                w = recip(p(1) + p(2) * fo + p(3) * fo**2)
+            case (3)
+                w = stol**p(1)
+            case (4)
+                w = (1.0d0 / stol)**p(1)
+            case (5)
+                w = recip(sig**2)
+            case (6)
+                w = 1.0d0
+            case (7)
+                if (p(1) <= 0.0d0) return
+                w = 1.0d0 / (1.0d0 + ((fo - p(2)) / p(1))**2)
+            case (8)
+                w = 1.0d0
+                if (fo > p(1)) w = p(1) / fo
+            case (9)
+                w = sig
+            case (10)
+                w = recip(sig)
+            case (11)
+                w = stol**p(1) * recip(p(2) + p(3) * fo + p(4) * fo**2)
+            case (12)
+                w = recip(sig**2 + p(1) * fo + p(2) * fo**2)
+            case (13)
+                w = recip(p(1) + p(2) * fo + p(3) * fo**2 + p(4) * stol)
+            case (14)
+                w = recip(p(1) + p(2) * fo + p(3) * fo**2)
+            case (15)
+                w = recip(p(1) + p(2) * stol + p(3) * stol**2)
+            case (17)
+                w = stol**p(3) * recip((p(1) * sig)**2 + p(2) * fo**2)
+            case (18)
+                w = recip((p(1) + p(2) * fo + p(3) * fo**2 + p(4) * stol**p(5)) * sig**2)
+            case default
+                return
+        end select
+        
+        w = w / (2.0d0 * fo)**2
+        if (.not. (w > 0.0d0 .and. w <= huge(w))) w = 0.0d0
+        
+    contains
+        
+        pure function recip(x) result(r)
+            real(c_double), intent(in) :: x
+            real(c_double) :: r
+            r = 0.0d0
+            if (x > 0.0d0) r = 1.0d0 / x
+        end function recip
+        
+    end function scheme_weight
+    
     ! Subroutine to get atom data
-    subroutine lsq_get_atoms(num_atoms, atom_names, fix_xyz, fix_b, fix_occ, &
+    ! Atom names are written NUL-terminated into the caller's name_arena;
+    ! name_offsets(i) receives the 0-based offset of name i in the arena.
+    ! arena_used always returns the bytes all names need; if that exceeds
+    ! arena_capacity nothing past it is written and ier = 1, so a first call
+    ! with arena_capacity = 0 sizes the arena.
+    subroutine lsq_get_atoms(num_atoms, name_arena, arena_capacity, name_offsets, &
+                             arena_used, fix_xyz, fix_b, fix_occ, &
                              set_isotropic, ier) bind(C, name="lsq_get_atoms")
         integer(c_int), intent(in), value :: num_atoms
-        type(c_ptr), dimension(num_atoms), intent(out) :: atom_names
+        character(kind=c_char), intent(out) :: name_arena(*)
+        integer(c_int), intent(in), value :: arena_capacity
+        integer(c_int), intent(out) :: name_offsets(*)
+        integer(c_int), intent(out) :: arena_used
         integer(c_int), intent(out) :: fix_xyz(*)
         integer(c_int), intent(out) :: fix_b(*)
         integer(c_int), intent(out) :: fix_occ(*)
         integer(c_int), intent(out) :: set_isotropic(*)
         integer(c_int), intent(out) :: ier
         
-        integer :: i
-        character(len=20, kind=c_char), pointer :: temp_name
+        integer :: i, j, name_len
+        character(len=20) :: temp_name
+        
+        arena_used = 0
+        ier = 0
         
         ! Initialize arrays
         do i = 1, num_atoms
-            ! Allocate and create example atom names (C, N, O, etc.)
-            allocate(temp_name)
-            
+            ! Create example atom names (C, N, O, etc.)
             select case(mod(i-1, 5))
                 case(0)
-                    temp_name = "C" // trim(adjustl(str(i))) // c_null_char
+                    temp_name = "C" // trim(adjustl(str(i)))
                 case(1)
-                    temp_name = "N" // trim(adjustl(str(i))) // c_null_char
+                    temp_name = "N" // trim(adjustl(str(i)))
                 case(2)
-                    temp_name = "O" // trim(adjustl(str(i))) // c_null_char
+                    temp_name = "O" // trim(adjustl(str(i)))
                 case(3)
-                    temp_name = "H" // trim(adjustl(str(i))) // c_null_char
+                    temp_name = "H" // trim(adjustl(str(i)))
                 case(4)
-                    temp_name = "S" // trim(adjustl(str(i))) // c_null_char
+                    temp_name = "S" // trim(adjustl(str(i)))
             end select
             
-            ! Store the C pointer to the string
-            atom_names(i) = c_loc(temp_name)
+            ! Append the name and its terminator to the arena if it fits
+            name_len = len_trim(temp_name)
+            name_offsets(i) = arena_used
+            if (arena_used + name_len + 1 <= arena_capacity) then
+                do j = 1, name_len
+                    name_arena(arena_used + j) = temp_name(j:j)
+                end do
+                name_arena(arena_used + name_len + 1) = c_null_char
+            end if
+            arena_used = arena_used + name_len + 1
             
             ! Initialize flags with example values (some atoms fixed, some not)
             fix_xyz(i) = mod(i, 3)          ! Every 3rd atom has fix_xyz = 0
@@ -266,7 +1624,10 @@ contains
             set_isotropic(i) = mod(i, 2)    ! Alternating pattern
         end do
         
-        ier = 0
+        if (arena_used > arena_capacity) then
+            ier = 1
+            return
+        end if
         
         print *, "Fortran: Returning atom data for ", num_atoms, " atoms"
         
@@ -8,6 +8,44 @@
 #include <QHeaderView>
 #include <QTableWidgetItem>
 
+// Atom name cell that reads its text from the shared AtomNameTable instead of
+// holding its own copy. The QString is only built the first time it is shown.
+class AtomNameItem : public QTableWidgetItem
+{
+public:
+    AtomNameItem(const AtomNameTable &names, int index)
+        : QTableWidgetItem(QTableWidgetItem::UserType)
+        , names(names)
+        , index(index)
+        , decoded(false)
+    {}
+
+    QVariant data(int role) const override
+    {
+        if (role == Qt::DisplayRole || role == Qt::EditRole) {
+            if (!decoded) {
+                cachedName = names.name(index);
+                decoded = true;
+            }
+            return cachedName;
+        }
+        return QTableWidgetItem::data(role);
+    }
+
+    QTableWidgetItem *clone() const override
+    {
+        AtomNameItem *item = new AtomNameItem(names, index);
+        *static_cast<QTableWidgetItem*>(item) = *this;
+        return item;
+    }
+
+private:
+    AtomNameTable names;
+    int index;
+    mutable QString cachedName;
+    mutable bool decoded;
+};
+
 LSQDialog::LSQDialog(QWidget *parent)
     : QDialog(parent)
     , ui(new Ui::LSQDialog)
@@ -51,12 +89,19 @@ LSQDialog::LSQDialog(QWidget *parent)
                 }
             });
     
+    // Mixed precision only applies to the full-matrix solve
+    connect(ui->fullMatrixRadio, &QRadioButton::toggled,
+            ui->mixedPrecisionCheck, &QCheckBox::setEnabled);
+    
     // Connect Modify weight parameters button
     connect(ui->modifyWeightButton, &QPushButton::clicked,
             this, &LSQDialog::onModifyWeightParameters);
     
     // Setup atoms table
     setupAtomsTable();
+    
+    // Setup statistics table
+    setupStatisticsTable();
 }
 
 LSQDialog::~LSQDialog()
@@ -66,9 +111,25 @@ LSQDialog::~LSQDialog()
 
 void LSQDialog::onLSQRun()
 {
-    // Set the apply pressed flag and accept the dialog
+    // Set the apply pressed flag and run; the dialog stays open so the
+    // statistics of each run can be compared
     applyPressed = true;
-    accept();
+    
+    MainWindow *mainWindow = qobject_cast<MainWindow*>(parentWidget());
+    if (mainWindow) {
+        LSQStatistics stats = mainWindow->runLSQ(getParameters());
+        
+        // Keep refined weight parameters so the next run starts from them
+        if (stats.refinedWeightScheme >= 0 && stats.refinedWeightScheme < allWeightParams.size()) {
+            allWeightParams[stats.refinedWeightScheme] = stats.refinedWeightParams;
+            weightParameters = stats.refinedWeightParams;
+        }
+        
+        setStatistics(stats);
+        // The run replaced the factor the esds come from
+        updateAtomEsds(ui->atomsTable->currentRow());
+        ui->tabWidget->setCurrentWidget(ui->statisticsTab);
+    }
 }
 
 void LSQDialog::onModifyWeightParameters()
@@ -122,6 +183,7 @@ void LSQDialog::setParameters(const LSQParameters &params)
             ui->sfcOnlyRadio->setChecked(true);
             break;
     }
+    ui->mixedPrecisionCheck->setChecked(params.mixedPrecision);
     
     // Set Refinement Conditions
     ui->dampingFactorSpin->setValue(params.dampingFactor);
@@ -142,6 +204,10 @@ void LSQDialog::setParameters(const LSQParameters &params)
     ui->parametersLabel->setText(QString("Parameters: %1").arg(params.numParameters));
     ui->ratioLabel->setText(QString("Ratio: %1").arg(params.ratio, 0, 'f', 2));
     
+    // Statistics and esds belong to runs of the previous parameters
+    setStatistics(LSQStatistics());
+    ui->esdLabel->setText("Esd (x, y, z): -");
+    
     // Populate atoms table
     populateAtomsTable(params);
 }
@@ -163,6 +229,7 @@ LSQParameters LSQDialog::getParameters() const
     } else if (ui->sfcOnlyRadio->isChecked()) {
         params.refinementType = LSQParameters::SFCOnly;
     }
+    params.mixedPrecision = ui->mixedPrecisionCheck->isChecked();
     
     // Get Refinement Conditions
     params.dampingFactor = ui->dampingFactorSpin->value();
@@ -173,18 +240,19 @@ LSQParameters LSQDialog::getParameters() const
     params.weightingSchemeIndex = ui->weightingSchemeCombo->currentIndex();
     params.weightParameters = weightParameters;
     params.refineWeightParams = ui->refineWeightCheck->isChecked();
+    params.numWeightParamsPerScheme = numWeightParamsPerScheme;
+    params.allWeightParams = allWeightParams;
     
     // Get Atoms data from table
     int rowCount = ui->atomsTable->rowCount();
     params.numAtoms = rowCount;
-    params.atomNames.clear();
+    params.atomNames = atomNames;  // Names are read-only, share the table
     params.fixXYZ.clear();
     params.fixB.clear();
     params.fixOcc.clear();
     params.setIsotropic.clear();
     
     // Resize vectors to hold all atoms
-    params.atomNames.resize(rowCount);
     params.fixXYZ.resize(rowCount);
     params.fixB.resize(rowCount);
     params.fixOcc.resize(rowCount);
@@ -200,9 +268,6 @@ LSQParameters LSQDialog::getParameters() const
             if (userData.isValid()) {
                 originalIndex = userData.toInt();
             }
-            params.atomNames[originalIndex] = atomItem->text();
-        } else {
-            params.atomNames[originalIndex] = QString("Atom_%1").arg(originalIndex + 1);
         }
         
         // Get Fix XYZ
@@ -225,6 +290,82 @@ LSQParameters LSQDialog::getParameters() const
     return params;
 }
 
+void LSQDialog::setStatistics(const LSQStatistics &stats)
+{
+    if (!stats.valid) {
+        ui->r1Label->setText("R1: -");
+        ui->wr2Label->setText("wR2: -");
+        ui->goofLabel->setText("GooF: -");
+        ui->statisticsLabel->setText("No refinement has been run yet.");
+        ui->statisticsTable->setRowCount(0);
+        return;
+    }
+    
+    // Summary next to the Observations & Parameters labels
+    ui->r1Label->setText(QString("R1: %1").arg(stats.r1, 0, 'f', 4));
+    ui->wr2Label->setText(QString("wR2: %1").arg(stats.wR2, 0, 'f', 4));
+    ui->goofLabel->setText(QString("GooF: %1 (run %2)").arg(stats.goof, 0, 'f', 3).arg(stats.run));
+    QString summary = QString("Run %1, cycle %2: %3 reflections")
+                      .arg(stats.run)
+                      .arg(stats.cycle)
+                      .arg(stats.numReflections);
+    if (stats.numZeroWeight > 0) {
+        summary += QString(" (%1 with weight <= 0, left out of wR2 and GooF)").arg(stats.numZeroWeight);
+    }
+    // Scheme 16 falls back to #5 until it has coefficients, so name the
+    // weights actually used; the schemes' W on Fo is applied to Fo^2 with Sc = 1
+    summary += QString("\nwR2 and GooF use the weights of scheme #%1 on Fo^2 (Sc = 1)")
+               .arg(stats.weightScheme + 1);
+    ui->statisticsLabel->setText(summary);
+    
+    // Cycle history first, then resolution shells and Fo bins of the last cycle
+    ui->statisticsTable->setRowCount(stats.cycles.size() + stats.resolutionShells.size()
+                                     + stats.foBins.size());
+    
+    int row = 0;
+    for (const LSQStatistics::Cycle &cycle : stats.cycles) {
+        ui->statisticsTable->setItem(row, 0, new QTableWidgetItem(QString("Cycle %1").arg(cycle.cycle)));
+        ui->statisticsTable->setItem(row, 1, new QTableWidgetItem());
+        ui->statisticsTable->setItem(row, 2, new QTableWidgetItem());
+        ui->statisticsTable->setItem(row, 3, new QTableWidgetItem());
+        ui->statisticsTable->setItem(row, 4, new QTableWidgetItem(QString::number(cycle.r1, 'f', 4)));
+        ui->statisticsTable->setItem(row, 5, new QTableWidgetItem(QString::number(cycle.wR2, 'f', 4)));
+        ui->statisticsTable->setItem(row, 6, new QTableWidgetItem(QString::number(cycle.goof, 'f', 3)));
+        ++row;
+    }
+    
+    auto addBin = [this, &row](const QString &name, const LSQStatistics::Bin &bin, int decimals) {
+        ui->statisticsTable->setItem(row, 0, new QTableWidgetItem(name));
+        ui->statisticsTable->setItem(row, 1, new QTableWidgetItem(QString::number(bin.lower, 'f', decimals)));
+        ui->statisticsTable->setItem(row, 2, new QTableWidgetItem(QString::number(bin.upper, 'f', decimals)));
+        ui->statisticsTable->setItem(row, 3, new QTableWidgetItem(QString::number(bin.numReflections)));
+        ui->statisticsTable->setItem(row, 4, new QTableWidgetItem(QString::number(bin.r1, 'f', 4)));
+        ui->statisticsTable->setItem(row, 5, new QTableWidgetItem(QString::number(bin.wR2, 'f', 4)));
+        ui->statisticsTable->setItem(row, 6, new QTableWidgetItem());
+        ++row;
+    };
+    
+    for (int i = 0; i < stats.resolutionShells.size(); ++i) {
+        addBin(QString("Sin(Th)/L shell %1").arg(i + 1), stats.resolutionShells[i], 4);
+    }
+    for (int i = 0; i < stats.foBins.size(); ++i) {
+        addBin(QString("Fo bin %1").arg(i + 1), stats.foBins[i], 2);
+    }
+}
+
+void LSQDialog::setupStatisticsTable()
+{
+    // Configure statistics table (read-only, filled by setStatistics)
+    ui->statisticsTable->setColumnCount(7);
+    ui->statisticsTable->setHorizontalHeaderLabels({"Cycle / Bin", "Lower", "Upper", "Nref", "R1", "wR2", "GooF"});
+    ui->statisticsTable->horizontalHeader()->setSectionResizeMode(0, QHeaderView::Stretch);
+    for (int i = 1; i < 7; ++i) {
+        ui->statisticsTable->horizontalHeader()->setSectionResizeMode(i, QHeaderView::ResizeToContents);
+    }
+    ui->statisticsTable->verticalHeader()->setVisible(false);
+    ui->statisticsTable->setSelectionBehavior(QAbstractItemView::SelectRows);
+}
+
 void LSQDialog::setupAtomsTable()
 {
     // Configure atoms table
@@ -261,6 +402,12 @@ void LSQDialog::setupAtomsTable()
         ui->atomsTable->setItemDelegateForColumn(col, delegate);
     }
     
+    // Show the esds of the selected atom (requested on demand)
+    connect(ui->atomsTable, &QTableWidget::currentCellChanged,
+            this, [this](int currentRow) {
+                updateAtomEsds(currentRow);
+            });
+    
     // Connect to cell changes to update header checkboxes
     connect(ui->atomsTable, &QTableWidget::itemChanged,
             this, [this](QTableWidgetItem *item) {
@@ -270,6 +417,44 @@ void LSQDialog::setupAtomsTable()
             });
 }
 
+void LSQDialog::updateAtomEsds(int row)
+{
+    QTableWidgetItem *atomItem = ui->atomsTable->item(row, 0);
+    MainWindow *mainWindow = qobject_cast<MainWindow*>(parentWidget());
+    if (!atomItem || !mainWindow) {
+        ui->esdLabel->setText("Esd (x, y, z): -");
+        return;
+    }
+    
+    // Esds are indexed by the original atom position, not the sorted row
+    int originalIndex = atomItem->data(Qt::UserRole).toInt();
+    double esd[3];
+    double relError;
+    bool singlePrecision;
+    if (mainWindow->atomEsds(originalIndex, esd, &relError, &singlePrecision)) {
+        QString text = QString("Esd (x, y, z) of %1: %2, %3, %4")
+                           .arg(atomItem->text())
+                           .arg(esd[0], 0, 'f', 5)
+                           .arg(esd[1], 0, 'f', 5)
+                           .arg(esd[2], 0, 'f', 5);
+        // relError is a worst-case rounding bound; it matters for the
+        // single-precision factor of a mixed-precision run, or when nothing
+        // can be guaranteed at all
+        if (relError >= 1.0) {
+            text += singlePrecision
+                    ? QString(" (not reliable with the single-precision factor; run without mixed precision)")
+                    : QString(" (not reliable: normal matrix too ill-conditioned)");
+        } else if (singlePrecision) {
+            text += QString(" (single-precision factor, worst-case relative error %1)")
+                        .arg(relError, 0, 'e', 1);
+        }
+        ui->esdLabel->setText(text);
+    } else {
+        ui->esdLabel->setText(QString("Esd (x, y, z) of %1: not available (needs a Full Matrix run with free XYZ)")
+                              .arg(atomItem->text()));
+    }
+}
+
 void LSQDialog::populateAtomsTable(const LSQParameters &params)
 {
     int numAtoms = params.numAtoms;
@@ -282,14 +467,14 @@ void LSQDialog::populateAtomsTable(const LSQParameters &params)
     
     // Clear existing rows
     ui->atomsTable->setRowCount(0);
+    atomNames = params.atomNames;
     
     // Populate table with atoms
     ui->atomsTable->setRowCount(numAtoms);
     
     for (int row = 0; row < numAtoms; ++row) {
-        // Column 0: Atom name
-        QString atomName = (row < params.atomNames.size()) ? params.atomNames[row] : QString("Atom_%1").arg(row + 1);
-        QTableWidgetItem *atomItem = new QTableWidgetItem(atomName);
+        // Column 0: Atom name (resolved lazily from the shared name table)
+        QTableWidgetItem *atomItem = new AtomNameItem(atomNames, row);
         atomItem->setFlags(atomItem->flags() & ~Qt::ItemIsEditable);  // Make read-only
         atomItem->setData(Qt::UserRole, row);  // Store original index
         ui->atomsTable->setItem(row, 0, atomItem);
@@ -3,6 +3,7 @@
 
 #include <QDialog>
 #include <QVector>
+#include "atomnametable.h"
 
 class CheckBoxHeader;
 
@@ -13,6 +14,7 @@ QT_END_NAMESPACE
 struct LSQParameters {
     // Refinement Request
     enum RefinementType { Diagonal, FullMatrix, SFCOnly } refinementType;
+    bool mixedPrecision;  // FullMatrix only: single-precision factor + double refinement
     
     // Refinement Conditions
     double dampingFactor;
@@ -34,7 +36,7 @@ struct LSQParameters {
     
     // Atoms
     int numAtoms;
-    QVector<QString> atomNames;
+    AtomNameTable atomNames;  // Interned, shared by reference
     QVector<bool> fixXYZ;
     QVector<bool> fixB;
     QVector<bool> fixOcc;
@@ -42,6 +44,7 @@ struct LSQParameters {
     
     LSQParameters()
         : refinementType(Diagonal)
+        , mixedPrecision(false)
         , dampingFactor(0.5)
         , reflectionsCutoff(0)
         , numCycles(5)
@@ -63,6 +66,57 @@ struct LSQParameters {
     {}
 };
 
+struct LSQStatistics {
+    // One resolution shell (limits in Sin(Th)/L) or Fo bin (limits in Fo)
+    struct Bin {
+        double lower;
+        double upper;
+        int numReflections;
+        double r1;
+        double wR2;
+    };
+    
+    // Overall figures of one refinement cycle
+    struct Cycle {
+        int cycle;
+        double r1;
+        double wR2;
+        double goof;
+    };
+    
+    bool valid;
+    int run;  // Run number within this session (0 = no run)
+    int cycle;
+    int numReflections;
+    int numZeroWeight;  // Left out of wR2 and GooF for a non-positive weight
+    int weightScheme;   // Scheme (0-based) whose weights wR2 and GooF used
+    double r1;
+    double wR2;
+    double goof;
+    QVector<Bin> resolutionShells;
+    QVector<Bin> foBins;
+    QVector<Cycle> cycles;  // History of all cycles of the run
+    int refinedWeightScheme;  // Scheme whose parameters were refined, -1 if none
+    QVector<double> refinedWeightParams;
+    
+    LSQStatistics()
+        : valid(false)
+        , run(0)
+        , cycle(0)
+        , numReflections(0)
+        , numZeroWeight(0)
+        , weightScheme(0)
+        , r1(0.0)
+        , wR2(0.0)
+        , goof(0.0)
+        , resolutionShells()
+        , foBins()
+        , cycles()
+        , refinedWeightScheme(-1)
+        , refinedWeightParams()
+    {}
+};
+
 class LSQDialog : public QDialog
 {
     Q_OBJECT
@@ -73,6 +127,7 @@ public:
     
     void setParameters(const LSQParameters &params);
     LSQParameters getParameters() const;
+    void setStatistics(const LSQStatistics &stats);
 
 private slots:
     void onLSQRun();
@@ -82,11 +137,14 @@ private:
     void setupAtomsTable();
     void populateAtomsTable(const LSQParameters &params);
     void updateHeaderCheckBox(int column);
+    void setupStatisticsTable();
+    void updateAtomEsds(int row);
     
     Ui::LSQDialog *ui;
     QVector<double> weightParameters;
     QVector<int> numWeightParamsPerScheme;
     QVector<QVector<double>> allWeightParams;  // All parameters for all schemes [18][10]  
+    AtomNameTable atomNames;  // Names shown in the atoms table (read-only)
     bool applyPressed;
     CheckBoxHeader *checkboxHeader;
 
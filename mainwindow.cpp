@@ -2,9 +2,15 @@
 #include "ui_mainwindow.h"
 #include <QMessageBox>
 
+// Maximum number of resolution shells / Fo bins returned by the statistics stage
+static const int kMaxStatBins = 20;
+
+// Maximum number of cycles in the statistics history (cycles spin box allows 100)
+static const int kMaxStatCycles = 101;
+
 // Fortran subroutines declarations
 extern "C" {
-    void lsq_get_parameters(int* refinement_type, double* damping_factor,
+    void lsq_get_parameters(int* refinement_type, int* mixed_precision, double* damping_factor,
                            int* reflections_cutoff, int* num_cycles,
                            int* weighting_scheme, double* weight_params,
                            int* refine_weight, int* num_observations,
@@ -12,20 +18,38 @@ extern "C" {
                            double* ratio, int* num_weight_params,
                            double* all_weight_params, int* num_atoms, int* ier);
     
-    void lsq_get_atoms(int num_atoms, char** atom_names, int* fix_xyz,
+    void lsq_get_atoms(int num_atoms, char* name_arena, int arena_capacity,
+                      int* name_offsets, int* arena_used, int* fix_xyz,
                       int* fix_b, int* fix_occ, int* set_isotropic, int* ier);
     
-    void lsq_execute(int refinement_type, double damping_factor,
+    void lsq_execute(int refinement_type, int mixed_precision, double damping_factor,
                     int reflections_cutoff, int num_cycles,
                     int weighting_scheme, double* weight_params,
                     int refine_weight, int num_atoms, int* fix_xyz,
                     int* fix_b, int* fix_occ, int* set_isotropic);
+    
+    void lsq_get_statistics(int max_bins, int* last_cycle, int* num_reflections,
+                           int* num_zero_weight, int* weight_scheme,
+                           double* r1, double* wr2, double* goof,
+                           int* num_shells, double* shell_stats,
+                           int* num_fo_bins, double* fo_bin_stats, int* ier);
+    
+    void lsq_get_cycle_history(int max_cycles, int* num_history, double* history, int* ier);
+    
+    void lsq_get_weight_params(double* weight_params, int* num_params, int* ier);
+    
+    void lsq_get_covariance(int num_indices, int* indices, double* cov, int* ier);
+    
+    void lsq_get_atoms_covariance(int num_atoms, int* atoms, double* cov, int* ier);
+    
+    void lsq_get_atom_esds(int atom, double* esd_xyz, double* rel_error, int* single_precision, int* ier);
 }
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
     , lsqDialog(nullptr)
+    , lsqRunCount(0)
 {
     ui->setupUi(this);
     
@@ -47,11 +71,177 @@ void MainWindow::openHelp(const QString &page)
     Q_UNUSED(page);
 }
 
+bool MainWindow::atomEsds(int atomIndex, double esdXYZ[3], double *relError,
+                          bool *singlePrecision) const
+{
+    // Esds come from the factor kept by the last Full Matrix run; Fortran
+    // computes (and caches) only the columns of the inverse it needs.
+    // relError is a worst-case bound on their relative error from rounding
+    // (1 = no accuracy can be claimed).
+    double error;
+    int single;
+    int ier;
+    lsq_get_atom_esds(atomIndex + 1, esdXYZ, &error, &single, &ier);
+    if (relError) {
+        *relError = error;
+    }
+    if (singlePrecision) {
+        *singlePrecision = (single != 0);
+    }
+    return ier == 0;
+}
+
+bool MainWindow::covariance(const QVector<int> &parameters, QVector<double> &cov) const
+{
+    // Block Cov(p(a), p(b)) of the given (0-based) refined parameters,
+    // column-major, n x n
+    int n = parameters.size();
+    QVector<int> indices(n);
+    for (int i = 0; i < n; ++i) {
+        indices[i] = parameters[i] + 1;
+    }
+    cov.resize(n * n);
+    int ier;
+    lsq_get_covariance(n, indices.data(), cov.data(), &ier);
+    return ier == 0;
+}
+
+bool MainWindow::atomsCovariance(const QVector<int> &atomIndices, QVector<double> &cov) const
+{
+    // Covariance of the x, y, z of the given atoms (3n x 3n, column-major,
+    // x, y, z of each atom in turn): the input of bond length and angle esds
+    int n = atomIndices.size();
+    QVector<int> atoms(n);
+    for (int i = 0; i < n; ++i) {
+        atoms[i] = atomIndices[i] + 1;
+    }
+    cov.resize(9 * n * n);
+    int ier;
+    lsq_get_atoms_covariance(n, atoms.data(), cov.data(), &ier);
+    return ier == 0;
+}
+
+LSQStatistics MainWindow::runLSQ(const LSQParameters &params)
+{
+    // 1. Pass parameters to Fortran for calculation
+    int refType = static_cast<int>(params.refinementType);
+    // Send the parameters of the selected scheme (e.g. the Chebyshev
+    // coefficients of scheme 16), not just the last ones edited
+    double wParams[10];
+    int scheme = params.weightingSchemeIndex;
+    const QVector<double> &schemeParams =
+        (scheme >= 0 && scheme < params.allWeightParams.size())
+            ? params.allWeightParams[scheme]
+            : params.weightParameters;
+    for (int i = 0; i < 10; ++i) {
+        wParams[i] = (i < schemeParams.size()) ? schemeParams[i] : 0.0;
+    }
+    int refWeight = params.refineWeightParams ? 1 : 0;
+    
+    // Prepare atoms data
+    int numAtomsResult = params.numAtoms;
+    int fixXYZ[numAtomsResult];
+    int fixB[numAtomsResult];
+    int fixOcc[numAtomsResult];
+    int setIsotropic[numAtomsResult];
+    
+    for (int i = 0; i < numAtomsResult; ++i) {
+        fixXYZ[i] = (i < params.fixXYZ.size() && params.fixXYZ[i]) ? 1 : 0;
+        fixB[i] = (i < params.fixB.size() && params.fixB[i]) ? 1 : 0;
+        fixOcc[i] = (i < params.fixOcc.size() && params.fixOcc[i]) ? 1 : 0;
+        setIsotropic[i] = (i < params.setIsotropic.size() && params.setIsotropic[i]) ? 1 : 0;
+    }
+    
+    lsq_execute(refType, params.mixedPrecision ? 1 : 0, params.dampingFactor,
+                params.reflectionsCutoff, params.numCycles,
+                params.weightingSchemeIndex, wParams, refWeight,
+                numAtomsResult, fixXYZ, fixB, fixOcc, setIsotropic);
+    
+    // 2. Get the statistics of the last cycle and the history of all cycles
+    LSQStatistics stats;
+    stats.run = ++lsqRunCount;
+    int lastCycle;
+    int numReflections;
+    int numZeroWeight;
+    int numShells;
+    int numFoBins;
+    double shellStats[5 * kMaxStatBins];  // (lower, upper, nref, R1, wR2) per bin
+    double foBinStats[5 * kMaxStatBins];
+    int ierStats;
+    
+    lsq_get_statistics(kMaxStatBins, &lastCycle, &numReflections, &numZeroWeight,
+                       &stats.weightScheme, &stats.r1, &stats.wR2, &stats.goof,
+                       &numShells, shellStats, &numFoBins, foBinStats, &ierStats);
+    
+    if (ierStats == 0) {
+        stats.valid = true;
+        stats.cycle = lastCycle;
+        stats.numReflections = numReflections;
+        stats.numZeroWeight = numZeroWeight;
+        
+        auto toBin = [](const double *column) {
+            LSQStatistics::Bin bin;
+            bin.lower = column[0];
+            bin.upper = column[1];
+            bin.numReflections = static_cast<int>(column[2]);
+            bin.r1 = column[3];
+            bin.wR2 = column[4];
+            return bin;
+        };
+        for (int i = 0; i < numShells; ++i) {
+            stats.resolutionShells.append(toBin(shellStats + 5 * i));
+        }
+        for (int i = 0; i < numFoBins; ++i) {
+            stats.foBins.append(toBin(foBinStats + 5 * i));
+        }
+    }
+    
+    int numHistory;
+    double history[4 * kMaxStatCycles];  // (cycle, R1, wR2, GooF) per cycle
+    int ierHistory;
+    lsq_get_cycle_history(kMaxStatCycles, &numHistory, history, &ierHistory);
+    if (ierHistory == 0) {
+        for (int i = 0; i < numHistory; ++i) {
+            LSQStatistics::Cycle cycle;
+            cycle.cycle = static_cast<int>(history[4 * i]);
+            cycle.r1 = history[4 * i + 1];
+            cycle.wR2 = history[4 * i + 2];
+            cycle.goof = history[4 * i + 3];
+            stats.cycles.append(cycle);
+        }
+    }
+    
+    // 3. Weight parameters refined during the run (Chebyshev scheme 16)
+    double refinedParams[10];
+    int numRefinedParams;
+    int ierWeights;
+    lsq_get_weight_params(refinedParams, &numRefinedParams, &ierWeights);
+    if (ierWeights == 0) {
+        stats.refinedWeightScheme = params.weightingSchemeIndex;
+        stats.refinedWeightParams = QVector<double>(10, 0.0);
+        for (int i = 0; i < numRefinedParams && i < 10; ++i) {
+            stats.refinedWeightParams[i] = refinedParams[i];
+        }
+    }
+    
+    if (stats.valid) {
+        ui->statusbar->showMessage(QString("LSQ run %1: R1 = %2, wR2 = %3, GooF = %4 (cycle %5)")
+                                   .arg(stats.run)
+                                   .arg(stats.r1, 0, 'f', 4)
+                                   .arg(stats.wR2, 0, 'f', 4)
+                                   .arg(stats.goof, 0, 'f', 3)
+                                   .arg(stats.cycle));
+    }
+    
+    return stats;
+}
+
 void MainWindow::onNewProject()
 {
     if (lsqDialog) {
         // 1. Call Fortran to get initial parameters
         int refinementType;
+        int mixedPrecision;
         double dampingFactor;
         int reflectionsCutoff;
         int numCycles;
@@ -67,7 +257,7 @@ void MainWindow::onNewProject()
         int numAtoms;
         int ier;
         
-        lsq_get_parameters(&refinementType, &dampingFactor, &reflectionsCutoff,
+        lsq_get_parameters(&refinementType, &mixedPrecision, &dampingFactor, &reflectionsCutoff,
                           &numCycles, &weightingScheme, weightParams, &refineWeight,
                           &numObservations, &percentObservations, &numParameters,
                           &ratio, numWeightParams, allWeightParams, &numAtoms, &ier);
@@ -82,6 +272,7 @@ void MainWindow::onNewProject()
         // 2. Set the dialog parameters with values from Fortran
         LSQParameters params;
         params.refinementType = static_cast<LSQParameters::RefinementType>(refinementType);
+        params.mixedPrecision = (mixedPrecision != 0);
         params.dampingFactor = dampingFactor;
         params.reflectionsCutoff = reflectionsCutoff;
         params.numCycles = numCycles;
@@ -110,21 +301,27 @@ void MainWindow::onNewProject()
         
         // Get atom data from Fortran
         if (numAtoms > 0) {
-            char* atomNames[numAtoms];
+            // Fortran fills the name arena directly; it is adopted as-is.
+            // A first call with no arena returns the bytes the names need.
+            QVector<int> nameOffsets(numAtoms);
+            int arenaUsed = 0;
             int fixXYZ[numAtoms];
             int fixB[numAtoms];
             int fixOcc[numAtoms];
             int setIsotropic[numAtoms];
             int ierAtoms;
             
-            lsq_get_atoms(numAtoms, atomNames, fixXYZ, fixB, fixOcc, setIsotropic, &ierAtoms);
+            lsq_get_atoms(numAtoms, nullptr, 0, nameOffsets.data(),
+                          &arenaUsed, fixXYZ, fixB, fixOcc, setIsotropic, &ierAtoms);
+            QByteArray nameArena(arenaUsed, Qt::Uninitialized);
+            lsq_get_atoms(numAtoms, nameArena.data(), static_cast<int>(nameArena.size()), nameOffsets.data(),
+                          &arenaUsed, fixXYZ, fixB, fixOcc, setIsotropic, &ierAtoms);
             
             if (ierAtoms == 0) {
-                // Convert atom data to QVectors
+                params.atomNames = AtomNameTable::fromArena(nameArena, nameOffsets);
+                
+                // Convert atom flags to QVectors
                 for (int i = 0; i < numAtoms; ++i) {
-                    // Extract atom name (null-terminated string pointer)
-                    QString atomName = QString::fromUtf8(atomNames[i]);
-                    params.atomNames.append(atomName);
                     params.fixXYZ.append(fixXYZ[i] != 0);
                     params.fixB.append(fixB[i] != 0);
                     params.fixOcc.append(fixOcc[i] != 0);
@@ -135,41 +332,8 @@ void MainWindow::onNewProject()
         
         lsqDialog->setParameters(params);
         
-        // 3. Execute the dialog (modal)
-        if (lsqDialog->exec() == QDialog::Accepted) {
-            // 4. Get parameters from dialog (only if Apply was pressed)
-            LSQParameters resultParams = lsqDialog->getParameters();
-            
-            // 5. Pass parameters to Fortran for calculation
-            int refType = static_cast<int>(resultParams.refinementType);
-            double wParams[10];
-            for (int i = 0; i < 10; ++i) {
-                wParams[i] = resultParams.weightParameters[i];
-            }
-            int refWeight = resultParams.refineWeightParams ? 1 : 0;
-            
-            // Prepare atoms data
-            int numAtomsResult = resultParams.numAtoms;
-            int fixXYZ[numAtomsResult];
-            int fixB[numAtomsResult];
-            int fixOcc[numAtomsResult];
-            int setIsotropic[numAtomsResult];
-            
-            for (int i = 0; i < numAtomsResult; ++i) {
-                fixXYZ[i] = (i < resultParams.fixXYZ.size() && resultParams.fixXYZ[i]) ? 1 : 0;
-                fixB[i] = (i < resultParams.fixB.size() && resultParams.fixB[i]) ? 1 : 0;
-                fixOcc[i] = (i < resultParams.fixOcc.size() && resultParams.fixOcc[i]) ? 1 : 0;
-                setIsotropic[i] = (i < resultParams.setIsotropic.size() && resultParams.setIsotropic[i]) ? 1 : 0;
-            }
-            
-            lsq_execute(refType, resultParams.dampingFactor,
-                       resultParams.reflectionsCutoff, resultParams.numCycles,
-                       resultParams.weightingSchemeIndex, wParams, refWeight,
-                       numAtomsResult, fixXYZ, fixB, fixOcc, setIsotropic);
-            
-            QMessageBox::information(this, "LSQ Complete", 
-                                   "Least Squares Refinement calculation completed!\n"
-                                   "Check terminal for Fortran output.");
-        }
+        // 3. Execute the dialog (modal); each LSQ Run calls runLSQ() and the
+        //    dialog stays open to show the statistics of the run
+        lsqDialog->exec();
     }
 }
@@ -17,6 +17,11 @@ public:
     ~MainWindow();
     
     void openHelp(const QString &page = QString());
+    bool atomEsds(int atomIndex, double esdXYZ[3], double *relError = nullptr,
+                  bool *singlePrecision = nullptr) const;
+    bool covariance(const QVector<int> &parameters, QVector<double> &cov) const;
+    bool atomsCovariance(const QVector<int> &atomIndices, QVector<double> &cov) const;
+    LSQStatistics runLSQ(const LSQParameters &params);
 
 private slots:
     void onNewProject();
@@ -24,6 +29,7 @@ private slots:
 private:
     Ui::MainWindow *ui;
     LSQDialog *lsqDialog;
+    int lsqRunCount;
 };
 
 #endif // MAINWINDOW_H